@@ -0,0 +1,109 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msearchd.h"
+
+/*
+ * A trivial bump allocator for the strings that live as long as a
+ * request.  Nothing is freed until the arena is reset, which keeps
+ * the first chunk around for the next request so that the usual one
+ * doesn't allocate at all.  Bigger ones get more chunks, released by
+ * the reset.  A zeroed arena uses chunks of ARENA_CHUNK bytes.
+ */
+
+#define ARENA_CHUNK	1024
+#define ARENA_ALIGN	sizeof(long long)
+
+struct arena_chunk {
+	struct arena_chunk	*ac_next;
+	size_t			 ac_size;
+	size_t			 ac_used;
+	long long		 ac_data[];
+};
+
+static inline size_t
+arena_chunksz(struct arena *a)
+{
+	return (a->a_chunksz != 0 ? a->a_chunksz : ARENA_CHUNK);
+}
+
+/*
+ * For the arenas that usually hold more than ARENA_CHUNK bytes.
+ */
+void
+arena_init(struct arena *a, size_t chunksz)
+{
+	a->a_chunks = NULL;
+	a->a_chunksz = chunksz;
+}
+
+void *
+arena_alloc(struct arena *a, size_t len)
+{
+	struct arena_chunk	*ac = a->a_chunks;
+	size_t			 size;
+	void			*p;
+
+	len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (ac == NULL || ac->ac_size - ac->ac_used < len) {
+		size = arena_chunksz(a);
+		if (len > size)
+			size = len;
+		if ((ac = malloc(sizeof(*ac) + size)) == NULL)
+			return (NULL);
+		ac->ac_next = a->a_chunks;
+		ac->ac_size = size;
+		ac->ac_used = 0;
+		a->a_chunks = ac;
+	}
+
+	p = (char *)ac->ac_data + ac->ac_used;
+	ac->ac_used += len;
+	return (p);
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	size_t			 len = strlen(s) + 1;
+	char			*p;
+
+	if ((p = arena_alloc(a, len)) != NULL)
+		memcpy(p, s, len);
+	return (p);
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk	*ac;
+
+	while ((ac = a->a_chunks) != NULL &&
+	    (ac->ac_next != NULL || ac->ac_size != arena_chunksz(a))) {
+		a->a_chunks = ac->ac_next;
+		free(ac);
+	}
+	if (ac != NULL)
+		ac->ac_used = 0;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_chunk	*ac;
+
+	while ((ac = a->a_chunks) != NULL) {
+		a->a_chunks = ac->ac_next;
+		free(ac);
+	}
+}
@@ -0,0 +1,430 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+
+#include <ctype.h>
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+struct cache_entry {
+	char				*ce_key;
+	char				*ce_data;
+	size_t				 ce_len;
+	uint64_t			 ce_gen;
+
+	TAILQ_ENTRY(cache_entry)	 ce_lru;
+	RB_ENTRY(cache_entry)		 ce_nodes;
+};
+
+/*
+ * The shared cache is a fixed array of fixed-size slots in a segment
+ * mapped by all the children.  Slots are grouped in sets of
+ * SHCACHE_WAYS, the set being chosen by the hash of the key, and the
+ * least recently used slot of a set is evicted.
+ *
+ * Each slot is protected by a seqlock: writers make the sequence odd
+ * while updating the slot and readers copy the data out and retry if
+ * the sequence changed in the meantime.  Writers never wait: if a
+ * slot is busy the entry is not stored.
+ */
+#define SHCACHE_MAGIC	0x6d736331	/* msc1 */
+#define SHCACHE_SLOTSZ	(64 * 1024)
+#define SHCACHE_WAYS	4
+
+struct shcache_hdr {
+	uint32_t	 sh_magic;
+	uint32_t	 sh_nslots;
+	uint64_t	 sh_gen;
+	uint64_t	 sh_clock;
+};
+
+struct shcache_slot {
+	uint32_t	 ss_seq;
+	uint32_t	 ss_hash;
+	uint64_t	 ss_gen;
+	uint64_t	 ss_stamp;
+	uint32_t	 ss_keylen;
+	uint32_t	 ss_datalen;
+	char		 ss_data[];	/* key followed by the data */
+};
+
+#define SHCACHE_DATASZ	(SHCACHE_SLOTSZ - sizeof(struct shcache_slot))
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int	cache_entry_cmp(struct cache_entry *, struct cache_entry *);
+
+RB_PROTOTYPE_STATIC(cache_tree, cache_entry, ce_nodes, cache_entry_cmp);
+
+void
+cache_init(struct cache *cache, size_t max)
+{
+	memset(cache, 0, sizeof(*cache));
+	RB_INIT(&cache->c_entries);
+	TAILQ_INIT(&cache->c_lru);
+	cache->c_max = max;
+}
+
+static void
+cache_entry_free(struct cache *cache, struct cache_entry *ce)
+{
+	RB_REMOVE(cache_tree, &cache->c_entries, ce);
+	TAILQ_REMOVE(&cache->c_lru, ce, ce_lru);
+	cache->c_count--;
+
+	free(ce->ce_key);
+	free(ce->ce_data);
+	free(ce);
+}
+
+/*
+ * The key is the escaped fts query; the tokenizer is not case
+ * sensitive, so fold ASCII letters to share the entry between
+ * "OpenBSD" and "openbsd".
+ */
+int
+cache_key(const char *esc, char *buf, size_t bufsize)
+{
+	size_t		 i;
+
+	for (i = 0; esc[i] != '\0'; ++i) {
+		if (i == bufsize - 1)
+			return (-1);
+		buf[i] = tolower((unsigned char)esc[i]);
+	}
+
+	/* drop the trailing space left by query_parse */
+	while (i > 0 && buf[i - 1] == ' ')
+		i--;
+	buf[i] = '\0';
+	return (0);
+}
+
+int
+cache_get(struct cache *cache, const char *key, const char **data,
+    size_t *len)
+{
+	struct cache_entry	*ce, q;
+
+	if (cache->c_max == 0)
+		return (-1);
+
+	q.ce_key = (char *)key;
+	if ((ce = RB_FIND(cache_tree, &cache->c_entries, &q)) == NULL) {
+		cache->c_misses++;
+		return (-1);
+	}
+	if (ce->ce_gen != cache->c_gen) {
+		cache_entry_free(cache, ce);
+		cache->c_misses++;
+		return (-1);
+	}
+
+	cache->c_hits++;
+	TAILQ_REMOVE(&cache->c_lru, ce, ce_lru);
+	TAILQ_INSERT_HEAD(&cache->c_lru, ce, ce_lru);
+
+	*data = ce->ce_data;
+	*len = ce->ce_len;
+	return (0);
+}
+
+void
+cache_put(struct cache *cache, const char *key, const void *data,
+    size_t len)
+{
+	struct cache_entry	*ce, q;
+
+	if (cache->c_max == 0)
+		return;
+
+	q.ce_key = (char *)key;
+	if ((ce = RB_FIND(cache_tree, &cache->c_entries, &q)) != NULL)
+		cache_entry_free(cache, ce);
+
+	while (cache->c_count >= cache->c_max)
+		cache_entry_free(cache, TAILQ_LAST(&cache->c_lru, cache_lru));
+
+	if ((ce = calloc(1, sizeof(*ce))) == NULL ||
+	    (ce->ce_key = strdup(key)) == NULL ||
+	    (ce->ce_data = malloc(len)) == NULL) {
+		log_warn("%s", __func__);
+		if (ce != NULL)
+			free(ce->ce_key);
+		free(ce);
+		return;
+	}
+
+	memcpy(ce->ce_data, data, len);
+	ce->ce_len = len;
+	ce->ce_gen = cache->c_gen;
+
+	RB_INSERT(cache_tree, &cache->c_entries, ce);
+	TAILQ_INSERT_HEAD(&cache->c_lru, ce, ce_lru);
+	cache->c_count++;
+}
+
+void
+cache_flush(struct cache *cache)
+{
+	struct cache_entry	*ce;
+
+	while ((ce = TAILQ_FIRST(&cache->c_lru)) != NULL)
+		cache_entry_free(cache, ce);
+	cache->c_gen++;
+}
+
+/*
+ * Have the entries ignored from now on.  Only the generation moves:
+ * they are dropped when they are looked up or evicted.
+ */
+void
+cache_expire(struct cache *cache)
+{
+	cache->c_gen++;
+}
+
+size_t
+shcache_size(size_t budget)
+{
+	size_t		 nslots;
+
+	if (budget < sizeof(struct shcache_hdr))
+		return (0);
+
+	nslots = (budget - sizeof(struct shcache_hdr)) / SHCACHE_SLOTSZ;
+	nslots -= nslots % SHCACHE_WAYS;
+	if (nslots == 0)
+		return (0);
+	return (sizeof(struct shcache_hdr) + nslots * SHCACHE_SLOTSZ);
+}
+
+/*
+ * Called by the parent to format the segment.
+ */
+void
+shcache_format(void *seg, size_t size)
+{
+	struct shcache_hdr	*hdr = seg;
+
+	memset(seg, 0, size);
+	hdr->sh_nslots = (size - sizeof(*hdr)) / SHCACHE_SLOTSZ;
+	hdr->sh_gen = 1;
+	hdr->sh_magic = SHCACHE_MAGIC;
+}
+
+int
+shcache_attach(struct shcache *sc, int fd)
+{
+	struct stat		 sb;
+	struct shcache_hdr	*hdr;
+	void			*seg;
+
+	memset(sc, 0, sizeof(*sc));
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("%s: fstat", __func__);
+		return (-1);
+	}
+
+	seg = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		return (-1);
+	}
+
+	hdr = seg;
+	if ((size_t)sb.st_size < sizeof(*hdr) ||
+	    hdr->sh_magic != SHCACHE_MAGIC ||
+	    sizeof(*hdr) + (size_t)hdr->sh_nslots * SHCACHE_SLOTSZ >
+	    (size_t)sb.st_size) {
+		log_warnx("%s: bad shared cache segment", __func__);
+		munmap(seg, sb.st_size);
+		return (-1);
+	}
+
+	sc->sc_hdr = hdr;
+	sc->sc_slots = (char *)seg + sizeof(*hdr);
+	sc->sc_nslots = hdr->sh_nslots;
+	sc->sc_gen = LOAD(&hdr->sh_gen);
+	return (0);
+}
+
+/*
+ * Called after the database was re-opened.  Bump the generation
+ * unless some other child already did it since we last looked, so
+ * that a SIGHUP sent to all the children invalidates the cache only
+ * once.
+ */
+void
+shcache_reload(struct shcache *sc)
+{
+	uint64_t	 gen;
+
+	if (sc->sc_hdr == NULL)
+		return;
+
+	gen = sc->sc_gen;
+	if (!__atomic_compare_exchange_n(&sc->sc_hdr->sh_gen, &gen, gen + 1,
+	    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		sc->sc_gen = gen;
+	else
+		sc->sc_gen = gen + 1;
+}
+
+static uint32_t
+shcache_hash(const char *key, size_t len)
+{
+	uint32_t	 h = 2166136261U;	/* FNV-1a */
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static inline struct shcache_slot *
+shcache_slot(struct shcache *sc, size_t n)
+{
+	return ((struct shcache_slot *)(sc->sc_slots + n * SHCACHE_SLOTSZ));
+}
+
+/*
+ * Copy the data for key, if any, into the empty buffer buf.  genp is
+ * set to the generation of the copied entry.
+ */
+int
+shcache_get(struct shcache *sc, const char *key, struct evbuffer *buf,
+    uint64_t *genp)
+{
+	struct shcache_slot	*ss;
+	size_t			 keylen, set, i, len;
+	uint64_t		 gen;
+	uint32_t		 h, seq;
+
+	if (sc->sc_hdr == NULL)
+		return (-1);
+
+	gen = LOAD(&sc->sc_hdr->sh_gen);
+	if (gen != sc->sc_gen) {
+		sc->sc_misses++;
+		return (-1);
+	}
+
+	keylen = strlen(key);
+	h = shcache_hash(key, keylen);
+	set = (h % (sc->sc_nslots / SHCACHE_WAYS)) * SHCACHE_WAYS;
+
+	for (i = 0; i < SHCACHE_WAYS; ++i) {
+		ss = shcache_slot(sc, set + i);
+
+		seq = LOAD(&ss->ss_seq);
+		if (seq & 1)
+			continue;
+		if (ss->ss_hash != h || ss->ss_gen != gen ||
+		    ss->ss_keylen != keylen ||
+		    memcmp(ss->ss_data, key, keylen) != 0)
+			continue;
+
+		len = ss->ss_datalen;
+		if (len > SHCACHE_DATASZ - keylen)
+			continue;
+		*genp = ss->ss_gen;
+
+		if (evbuffer_add(buf, ss->ss_data + keylen, len) == -1)
+			return (-1);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(&ss->ss_seq) != seq ||
+		    LOAD(&sc->sc_hdr->sh_gen) != gen) {
+			/* raced with a writer or a reload */
+			evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+			continue;
+		}
+
+		STORE(&ss->ss_stamp,
+		    __atomic_add_fetch(&sc->sc_hdr->sh_clock, 1,
+		    __ATOMIC_RELAXED));
+		sc->sc_hits++;
+		return (0);
+	}
+
+	sc->sc_misses++;
+	return (-1);
+}
+
+void
+shcache_put(struct shcache *sc, const char *key, const void *data,
+    size_t len)
+{
+	struct shcache_slot	*ss, *victim = NULL;
+	size_t			 keylen, set, i;
+	uint64_t		 gen;
+	uint32_t		 h, seq;
+
+	if (sc->sc_hdr == NULL)
+		return;
+
+	keylen = strlen(key);
+	if (keylen > SHCACHE_DATASZ || len > SHCACHE_DATASZ - keylen)
+		return;
+
+	gen = LOAD(&sc->sc_hdr->sh_gen);
+	if (gen != sc->sc_gen)
+		return;		/* our results are stale */
+
+	h = shcache_hash(key, keylen);
+	set = (h % (sc->sc_nslots / SHCACHE_WAYS)) * SHCACHE_WAYS;
+
+	for (i = 0; i < SHCACHE_WAYS; ++i) {
+		ss = shcache_slot(sc, set + i);
+		if (ss->ss_gen != gen) {
+			victim = ss;
+			break;
+		}
+		if (ss->ss_hash == h && ss->ss_keylen == keylen &&
+		    memcmp(ss->ss_data, key, keylen) == 0) {
+			victim = ss;
+			break;
+		}
+		if (victim == NULL || ss->ss_stamp < victim->ss_stamp)
+			victim = ss;
+	}
+
+	seq = LOAD(&victim->ss_seq);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&victim->ss_seq,
+	    &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;		/* somebody else is writing it */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	victim->ss_hash = h;
+	victim->ss_gen = gen;
+	victim->ss_stamp = __atomic_add_fetch(&sc->sc_hdr->sh_clock, 1,
+	    __ATOMIC_RELAXED);
+	victim->ss_keylen = keylen;
+	victim->ss_datalen = len;
+	memcpy(victim->ss_data, key, keylen);
+	memcpy(victim->ss_data + keylen, data, len);
+
+	STORE(&victim->ss_seq, seq + 2);
+}
+
+static int
+cache_entry_cmp(struct cache_entry *a, struct cache_entry *b)
+{
+	return (strcmp(a->ce_key, b->ce_key));
+}
+
+RB_GENERATE_STATIC(cache_tree, cache_entry, ce_nodes, cache_entry_cmp);
@@ -19,11 +19,55 @@
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "log.h"
 #include "msearchd.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 
+/*
+ * The output of a client is accumulated in clt_out and moved to the
+ * bufferevent in records as big as the protocol allows.  libevent 2
+ * moves the data without copying it and allows the templates to be
+ * queued by reference; it's not worth for short strings.
+ */
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02000000
+#define HAVE_EVBUFFER_REF	1
+#else
+#define HAVE_EVBUFFER_REF	0
+#endif
+
+#define CLT_REF_MIN		512
+
+/*
+ * The connections and the requests that are done are kept in free
+ * lists for the next ones, with their buffers.  libevent 2 can also
+ * move a bufferevent to another socket.
+ */
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02000000
+#define HAVE_BUFFEREVENT_SETFD	1
+#else
+#define HAVE_BUFFEREVENT_SETFD	0
+#endif
+
+/*
+ * The records are parsed in place.  libevent 1.4 keeps the buffers
+ * contiguous, libevent 2 does it on request.
+ */
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02000000
+#define HAVE_EVBUFFER_PULLUP	1
+#else
+#define HAVE_EVBUFFER_PULLUP	0
+#endif
+
+#define FCGI_FREE_MAX		64
+#define CLT_FREE_MAX		MAX_REQUESTS
+
 struct fcgi_header {
 	unsigned char version;
 	unsigned char type;
@@ -41,6 +85,11 @@ struct fcgi_header {
  */
 #define FCGI_HEADER_LEN	8
 
+/*
+ * maximum length of the content of a record.
+ */
+#define FCGI_MAX_CONTENT	65535
+
 /*
  * values for the version component
  */
@@ -113,66 +162,111 @@ struct fcgi_end_req_body {
 
 #define CAT(f0, f1)	((f0) + ((f1) << 8))
 
+/*
+ * Once a connection has FCGI_OUT_HIWAT bytes of output pending, in
+ * the socket buffer or in its requests, no more records are read and
+ * the pages being rendered are paused, until it's back under
+ * FCGI_OUT_LOWAT.  Reading also stops while FCGI_HANDLED_MAX of its
+ * requests are being served, each holding a page of results.  The
+ * socket is read a record at a time at most, and the parameters of a
+ * request are limited to FCGI_PARAMS_MAX.
+ */
+#define FCGI_OUT_HIWAT		(4 * FCGI_MAX_CONTENT)
+#define FCGI_OUT_LOWAT		(2 * FCGI_MAX_CONTENT)
+#define FCGI_HANDLED_MAX	16
+#define FCGI_RECORD_MAX		(FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+#define FCGI_PARAMS_MAX		(64 * 1024)
+
 enum {
 	FCGI_RECORD_HEADER,
 	FCGI_RECORD_BODY,
 };
 
+/* a name-value pair, pointing into the record */
+struct fcgi_pair {
+	const unsigned char	*fp_name;
+	size_t			 fp_nlen;
+	const unsigned char	*fp_val;
+	size_t			 fp_vlen;
+};
+
 volatile int	fcgi_inflight;
+int		fcgi_busy;	/* requests not replied to yet */
 int32_t		fcgi_id;
+int		fcgi_nreqs;
+int		fcgi_retiring;
+
+static struct fcgi_list		fcgi_free_list =
+    TAILQ_HEAD_INITIALIZER(fcgi_free_list);
+static struct client_sched	clt_free_list =
+    TAILQ_HEAD_INITIALIZER(clt_free_list);
+static int			fcgi_nfree;
+static int			clt_nfree;
 
 int	accept_reserve(int, struct sockaddr *, socklen_t *, int,
     volatile int *);
 
+static int	fcgi_schedule(struct fcgi *);
+static size_t	fcgi_pending(struct fcgi *);
+static struct client *clt_new(void);
+static void	fcgi_pass_turn(struct env *);
+
 static int
-fcgi_send_end_req(struct fcgi *fcgi, int id, int as, int ps)
+fcgi_send_record(struct fcgi *fcgi, int type, int id, const void *buf,
+    size_t len)
 {
 	struct bufferevent	*bev = fcgi->fcg_bev;
 	struct fcgi_header	 hdr;
-	struct fcgi_end_req_body end;
 
 	memset(&hdr, 0, sizeof(hdr));
-	memset(&end, 0, sizeof(end));
-
 	hdr.version = FCGI_VERSION_1;
-	hdr.type = FCGI_END_REQUEST;
+	hdr.type = type;
 	hdr.req_id0 = (id & 0xFF);
 	hdr.req_id1 = (id >> 8);
-	hdr.content_len0 = sizeof(end);
-
-	end.app_status0 = (unsigned char)as;
-	end.proto_status = (unsigned char)ps;
+	hdr.content_len0 = (len & 0xFF);
+	hdr.content_len1 = (len >> 8);
 
 	if (bufferevent_write(bev, &hdr, sizeof(hdr)) == -1)
 		return (-1);
-	if (bufferevent_write(bev, &end, sizeof(end)) == -1)
+	if (len != 0 && bufferevent_write(bev, buf, len) == -1)
 		return (-1);
 	return (0);
 }
 
 static int
-end_request(struct client *clt, int status, int proto_status)
+fcgi_send_end_req(struct fcgi *fcgi, int id, int as, int ps)
 {
-	struct fcgi		*fcgi = clt->clt_fcgi;
-	int			 r;
-
-	if (clt_flush(clt) == -1)
-		return (-1);
+	struct fcgi_end_req_body end;
 
-	r = fcgi_send_end_req(fcgi, clt->clt_id, status,
-	    proto_status);
-	if (r == -1) {
-		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
-		return (-1);
-	}
+	memset(&end, 0, sizeof(end));
+	end.app_status0 = (unsigned char)as;
+	end.proto_status = (unsigned char)ps;
 
-	SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
-	server_client_free(clt);
+	return (fcgi_send_record(fcgi, FCGI_END_REQUEST, id, &end,
+	    sizeof(end)));
+}
 
-	if (!fcgi->fcg_keep_conn)
-		fcgi->fcg_done = 1;
+/*
+ * The reply is sent by fcgi_schedule once all the output queued so
+ * far has been written.
+ */
+static void
+fcgi_busy_add(int n)
+{
+	fcgi_busy += n;
+	stats_busy(fcgi_busy);
+}
 
-	return (0);
+static int
+end_request(struct client *clt, int status, int proto_status)
+{
+	stats_observe(SH_BYTES, clt->clt_bytes);
+	if (clt->clt_handled && !clt->clt_done)
+		fcgi_busy_add(-1);
+	clt->clt_done = 1;
+	clt->clt_status = status;
+	clt->clt_pstatus = proto_status;
+	return (clt_flush(clt));
 }
 
 int
@@ -187,12 +281,100 @@ fcgi_abort_request(struct client *clt)
 	return (end_request(clt, 1, FCGI_OVERLOADED));
 }
 
+static int
+fcgi_send_unknown(struct fcgi *fcgi, int type)
+{
+	unsigned char		 body[8];
+
+	memset(body, 0, sizeof(body));
+	body[0] = type;
+	return (fcgi_send_record(fcgi, FCGI_UNKNOWN_TYPE, 0, body,
+	    sizeof(body)));
+}
+
 static void
 fcgi_inflight_dec(const char *why)
 {
 	fcgi_inflight--;
+	stats_inflight(fcgi_inflight);
 	log_debug("%s: fcgi inflight decremented, now %d, %s",
 	    __func__, fcgi_inflight, why);
+
+	if (fcgi_retiring && fcgi_inflight == 0)
+		event_loopexit(NULL);
+}
+
+/*
+ * With -a the children take turns accepting the connections: the
+ * parent hands the turn to one child at a time through a pipe, and
+ * only that child polls the socket, so that a new connection wakes up
+ * one process instead of all of them.  The turn is given back after
+ * every accept, tagged with the slot of the child.
+ */
+void
+fcgi_take_turn(int fd, short event, void *arg)
+{
+	struct env	*env = arg;
+	char		 buf[16];
+	ssize_t		 n;
+
+	if ((n = read(fd, buf, sizeof(buf))) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		fatal("%s: read", __func__);
+	}
+
+	if (n == 0) {
+		/* the parent is gone: everyone accepts from now on. */
+		log_debug("%s: parent gone", __func__);
+		event_del(&env->env_turnev);
+		accept_serial = 0;
+	}
+
+	env->env_turn = 1;
+	if (fcgi_retiring)
+		fcgi_pass_turn(env);
+	else
+		event_add(&env->env_sockev, NULL);
+}
+
+static void
+fcgi_pass_turn(struct env *env)
+{
+	unsigned char	 slot = env->env_slot;
+
+	if (!accept_serial || !env->env_turn)
+		return;
+
+	if (write(ACCEPT_OUT_FD, &slot, 1) == -1) {
+		log_debug("%s: parent gone", __func__);
+		event_del(&env->env_turnev);
+		accept_serial = 0;
+		return;
+	}
+
+	env->env_turn = 0;
+	event_del(&env->env_sockev);
+}
+
+/*
+ * Stop accepting connections, and leave once the open ones are done
+ * or after RETIRE_TIMEOUT seconds anyway.
+ */
+void
+fcgi_retire(struct env *env)
+{
+	struct timeval	 tv = { RETIRE_TIMEOUT, 0 };
+
+	fcgi_retiring = 1;
+	fcgi_pass_turn(env);
+	event_del(&env->env_sockev);
+	event_del(&env->env_pausev);
+
+	if (fcgi_inflight == 0)
+		event_loopexit(NULL);
+	else
+		event_loopexit(&tv);
 }
 
 void
@@ -200,32 +382,43 @@ fcgi_accept(int fd, short event, void *arg)
 {
 	struct env		*env = arg;
 	struct fcgi		*fcgi = NULL;
+	struct bufferevent	*bev;
 	socklen_t		 slen;
 	struct sockaddr_storage	 ss;
 	int			 s = -1;
 
-	event_add(&env->env_pausev, NULL);
-	if ((event & EV_TIMEOUT))
+	if ((event & EV_TIMEOUT)) {
+		/* with -a we'll wait for our next turn instead */
+		if (!accept_serial && !fcgi_retiring)
+			event_add(&env->env_sockev, NULL);
 		return;
+	}
 
 	slen = sizeof(ss);
-	if ((s = accept_reserve(env->env_sockfd, (struct sockaddr *)&ss,
-	    &slen, FD_RESERVE, &fcgi_inflight)) == -1) {
+	s = accept_reserve(env->env_sockfd, (struct sockaddr *)&ss, &slen,
+	    FD_RESERVE, &fcgi_inflight);
+	if (s == -1 && (errno == ENFILE || errno == EMFILE)) {
 		/*
 		 * Pause accept if we are out of file descriptors, or
 		 * libevent will haunt us here too.
 		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
+		struct timeval evtpause = { 1, 0 };
 
-			event_del(&env->env_sockev);
-			evtimer_add(&env->env_pausev, &evtpause);
-			log_debug("%s: deferring connections", __func__);
-		}
-		return;
+		event_del(&env->env_sockev);
+		evtimer_add(&env->env_pausev, &evtpause);
+		log_debug("%s: deferring connections", __func__);
 	}
+	fcgi_pass_turn(env);
+	if (s == -1)
+		return;
 
-	if ((fcgi = calloc(1, sizeof(*fcgi))) == NULL)
+	if ((fcgi = TAILQ_FIRST(&fcgi_free_list)) != NULL) {
+		TAILQ_REMOVE(&fcgi_free_list, fcgi, fcg_free);
+		fcgi_nfree--;
+		bev = fcgi->fcg_bev;
+		memset(fcgi, 0, sizeof(*fcgi));
+		fcgi->fcg_bev = bev;
+	} else if ((fcgi = calloc(1, sizeof(*fcgi))) == NULL)
 		goto err;
 
 	fcgi->fcg_id = ++fcgi_id;
@@ -234,165 +427,256 @@ fcgi_accept(int fd, short event, void *arg)
 	fcgi->fcg_want = FCGI_RECORD_HEADER;
 	fcgi->fcg_toread = sizeof(struct fcgi_header);
 	SPLAY_INIT(&fcgi->fcg_clients);
+	TAILQ_INIT(&fcgi->fcg_sched);
+	TAILQ_INIT(&fcgi->fcg_paused);
 
 	/* assume it's enabled until we get a FCGI_BEGIN_REQUEST */
 	fcgi->fcg_keep_conn = 1;
 
+#if HAVE_BUFFEREVENT_SETFD
+	if (fcgi->fcg_bev != NULL) {
+		if (bufferevent_setfd(fcgi->fcg_bev, fcgi->fcg_s) == -1)
+			goto err;
+	} else
+#endif
 	fcgi->fcg_bev = bufferevent_new(fcgi->fcg_s, fcgi_read, fcgi_write,
 	    fcgi_error, fcgi);
 	if (fcgi->fcg_bev == NULL)
 		goto err;
 
+	stats_inflight(fcgi_inflight);
+
+	/* refill the socket buffer when it has less than a record */
+	bufferevent_setwatermark(fcgi->fcg_bev, EV_WRITE, FCGI_MAX_CONTENT, 0);
+	bufferevent_setwatermark(fcgi->fcg_bev, EV_READ, 0, FCGI_RECORD_MAX);
 	bufferevent_enable(fcgi->fcg_bev, EV_READ | EV_WRITE);
 	return;
 
 err:
 	if (s != -1) {
 		close(s);
+		if (fcgi != NULL && fcgi->fcg_bev != NULL)
+			bufferevent_free(fcgi->fcg_bev);
 		free(fcgi);
 		fcgi_inflight_dec(__func__);
 	}
 }
 
-static int
-parse_len(struct fcgi *fcgi, struct evbuffer *src)
+/*
+ * A contiguous view of the first len bytes of the buffer, which
+ * libevent 2 makes by moving them in a single chunk if needed.
+ */
+static const unsigned char *
+fcgi_pullup(struct evbuffer *src, size_t len)
 {
-	unsigned char		 c, x[3];
+	if (len == 0)
+		return ("");
+#if HAVE_EVBUFFER_PULLUP
+	return (evbuffer_pullup(src, len));
+#else
+	return (EVBUFFER_DATA(src));
+#endif
+}
 
-	fcgi->fcg_toread--;
-	evbuffer_remove(src, &c, 1);
-	if (c >> 7 == 0)
-		return (c);
+static int
+parse_len(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+	const unsigned char	*s = *p;
 
-	if (fcgi->fcg_toread < 3)
+	if (s == end)
 		return (-1);
 
-	fcgi->fcg_toread -= 3;
-	evbuffer_remove(src, x, sizeof(x));
-	return (((c & 0x7F) << 24) | (x[0] << 16) | (x[1] << 8) | x[2]);
+	if (*s >> 7 == 0) {
+		*len = *s;
+		*p = s + 1;
+		return (0);
+	}
+
+	if (end - s < 4)
+		return (-1);
+	*len = ((size_t)(s[0] & 0x7F) << 24) | (s[1] << 16) | (s[2] << 8) |
+	    s[3];
+	*p = s + 4;
+	return (0);
 }
 
+/*
+ * Get the next name-value pair of the record in [*p, end), pointing
+ * into it.  Returns 1 if there's one, 0 at the end or -1 if the
+ * record is malformed.
+ */
 static int
-fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
+next_pair(const unsigned char **p, const unsigned char *end,
+    struct fcgi_pair *fp)
 {
-	char			 pname[32];
-	char			 server[HOST_NAME_MAX + 1];
-	char			 path[PATH_MAX];
-	char			 query[QUERY_MAXLEN];
-	char			 method[8];
-	int			 nlen, vlen;
-
-	while (fcgi->fcg_toread > 0) {
-		if ((nlen = parse_len(fcgi, src)) < 0 ||
-		    (vlen = parse_len(fcgi, src)) < 0)
-			return (-1);
+	if (*p == end)
+		return (0);
 
-		if (fcgi->fcg_toread < nlen + vlen)
-			return (-1);
+	if (parse_len(p, end, &fp->fp_nlen) == -1 ||
+	    parse_len(p, end, &fp->fp_vlen) == -1 ||
+	    fp->fp_nlen > (size_t)(end - *p) ||
+	    fp->fp_vlen > (size_t)(end - *p) - fp->fp_nlen)
+		return (-1);
 
-		if ((size_t)nlen > sizeof(pname) - 1) {
-			/* ignore this parameter */
-			fcgi->fcg_toread -= nlen - vlen;
-			evbuffer_drain(src, nlen + vlen);
-			continue;
-		}
+	fp->fp_name = *p;
+	fp->fp_val = *p + fp->fp_nlen;
+	*p += fp->fp_nlen + fp->fp_vlen;
+	return (1);
+}
 
-		fcgi->fcg_toread -= nlen;
-		evbuffer_remove(src, &pname, nlen);
-		pname[nlen] = '\0';
+#define PAIR_IS(fp, s)							\
+	((fp)->fp_nlen == sizeof(s) - 1 &&				\
+	    !memcmp((fp)->fp_name, (s), sizeof(s) - 1))
 
-		if (!strcmp(pname, "SERVER_NAME") &&
-		    (size_t)vlen < sizeof(server)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &server, vlen);
-			server[vlen] = '\0';
+static int
+fcgi_get_values(struct fcgi *fcgi, struct evbuffer *src)
+{
+	struct fcgi_pair	 fp;
+	const unsigned char	*p, *end;
+	char			 val[16], reply[128];
+	size_t			 len = 0;
+	int			 r, vl;
 
-			free(clt->clt_server_name);
-			if ((clt->clt_server_name = strdup(server)) == NULL)
-				return (-1);
-			DPRINTF("clt %d: server_name: %s", clt->clt_id,
-			    clt->clt_server_name);
+	if ((p = fcgi_pullup(src, fcgi->fcg_toread)) == NULL)
+		return (-1);
+	end = p + fcgi->fcg_toread;
+
+	while ((r = next_pair(&p, end, &fp)) == 1) {
+		if (PAIR_IS(&fp, FCGI_MAX_CONNS) ||
+		    PAIR_IS(&fp, FCGI_MAX_REQS))
+			vl = snprintf(val, sizeof(val), "%d", MAX_REQUESTS);
+		else if (PAIR_IS(&fp, FCGI_MPXS_CONNS))
+			vl = snprintf(val, sizeof(val), "1");
+		else
 			continue;
-		}
-
-		if (!strcmp(pname, "SCRIPT_NAME") &&
-		    (size_t)vlen < sizeof(path)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &path, vlen);
-			path[vlen] = '\0';
-
-			free(clt->clt_script_name);
-			clt->clt_script_name = NULL;
-
-			if (vlen == 0 || path[vlen - 1] != '/')
-				asprintf(&clt->clt_script_name, "%s/", path);
-			else
-				clt->clt_script_name = strdup(path);
-
-			if (clt->clt_script_name == NULL)
-				return (-1);
 
-			DPRINTF("clt %d: script_name: %s", clt->clt_id,
-			    clt->clt_script_name);
+		if (len + 2 + fp.fp_nlen + vl > sizeof(reply))
 			continue;
-		}
-
-		if (!strcmp(pname, "PATH_INFO") &&
-		    (size_t)vlen < sizeof(path)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &path, vlen);
-			path[vlen] = '\0';
+		reply[len++] = fp.fp_nlen;
+		reply[len++] = vl;
+		memcpy(reply + len, fp.fp_name, fp.fp_nlen);
+		len += fp.fp_nlen;
+		memcpy(reply + len, val, vl);
+		len += vl;
+	}
+	if (r == -1)
+		return (-1);
 
-			free(clt->clt_path_info);
-			clt->clt_path_info = NULL;
+	evbuffer_drain(src, fcgi->fcg_toread);
+	fcgi->fcg_toread = 0;
 
-			if (*path != '/')
-				asprintf(&clt->clt_path_info, "/%s", path);
-			else
-				clt->clt_path_info = strdup(path);
+	return (fcgi_send_record(fcgi, FCGI_GET_VALUES_RESULT, 0, reply,
+	    len));
+}
 
-			if (clt->clt_path_info == NULL)
-				return (-1);
+/*
+ * Copy a parameter to the arena of the client, with the given prefix
+ * and suffix.
+ */
+static char *
+param_dup(struct client *clt, const char *pre, const struct fcgi_pair *fp,
+    const char *suf)
+{
+	size_t			 plen = strlen(pre), slen = strlen(suf);
+	char			*s;
 
-			DPRINTF("clt %d: path_info: %s", clt->clt_id,
-			    clt->clt_path_info);
-			continue;
-		}
+	s = arena_alloc(&clt->clt_arena, plen + fp->fp_vlen + slen + 1);
+	if (s == NULL)
+		return (NULL);
+	memcpy(s, pre, plen);
+	memcpy(s + plen, fp->fp_val, fp->fp_vlen);
+	memcpy(s + plen + fp->fp_vlen, suf, slen);
+	s[plen + fp->fp_vlen + slen] = '\0';
+	return (s);
+}
 
-		if (!strcmp(pname, "QUERY_STRING") &&
-		    (size_t)vlen < sizeof(query) &&
-		    vlen > 0) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &query, vlen);
-			query[vlen] = '\0';
+/*
+ * The parameters are parsed in place in the record: only those we
+ * use, and only the last time they appear, are copied.  The others
+ * are just skipped.
+ */
+static int
+fcgi_parse_params(struct fcgi *fcgi, struct evbuffer *src, struct client *clt)
+{
+	struct fcgi_pair	 fp, server, script, path, query, method;
+	const unsigned char	*p, *end, *v;
+	int			 r;
 
-			free(clt->clt_query);
-			if ((clt->clt_query = strdup(query)) == NULL)
-				return (-1);
+	if ((p = fcgi_pullup(src, fcgi->fcg_toread)) == NULL)
+		return (-1);
+	end = p + fcgi->fcg_toread;
+
+	server.fp_name = script.fp_name = path.fp_name = NULL;
+	query.fp_name = method.fp_name = NULL;
+
+	while ((r = next_pair(&p, end, &fp)) == 1) {
+		if (PAIR_IS(&fp, "SERVER_NAME") &&
+		    fp.fp_vlen <= HOST_NAME_MAX)
+			server = fp;
+		else if (PAIR_IS(&fp, "SCRIPT_NAME") &&
+		    fp.fp_vlen < PATH_MAX - 1)
+			script = fp;
+		else if (PAIR_IS(&fp, "PATH_INFO") &&
+		    fp.fp_vlen < PATH_MAX - 1)
+			path = fp;
+		else if (PAIR_IS(&fp, "QUERY_STRING") &&
+		    fp.fp_vlen < QUERY_MAXLEN && fp.fp_vlen > 0)
+			query = fp;
+		else if (PAIR_IS(&fp, "REQUEST_METHOD"))
+			method = fp;
+	}
+	if (r == -1)
+		return (-1);
 
-			DPRINTF("clt %d: query: %s", clt->clt_id,
-			    clt->clt_query);
-			continue;
-		}
+	if (server.fp_name != NULL) {
+		if ((clt->clt_server_name = param_dup(clt, "", &server, ""))
+		    == NULL)
+			return (-1);
+		DPRINTF("clt %d: server_name: %s", clt->clt_id,
+		    clt->clt_server_name);
+	}
 
-		if (!strcmp(pname, "REQUEST_METHOD") &&
-		    (size_t)vlen < sizeof(method)) {
-			fcgi->fcg_toread -= vlen;
-			evbuffer_remove(src, &method, vlen);
-			method[vlen] = '\0';
+	if (script.fp_name != NULL) {
+		v = script.fp_val;
+		if (script.fp_vlen == 0 || v[script.fp_vlen - 1] != '/')
+			clt->clt_script_name = param_dup(clt, "", &script,
+			    "/");
+		else
+			clt->clt_script_name = param_dup(clt, "", &script, "");
+		if (clt->clt_script_name == NULL)
+			return (-1);
+		DPRINTF("clt %d: script_name: %s", clt->clt_id,
+		    clt->clt_script_name);
+	}
 
-			if (!strcasecmp(method, "GET"))
-				clt->clt_method = METHOD_GET;
-			if (!strcasecmp(method, "POST"))
-				clt->clt_method = METHOD_POST;
+	if (path.fp_name != NULL) {
+		if (path.fp_vlen == 0 || *path.fp_val != '/')
+			clt->clt_path_info = param_dup(clt, "/", &path, "");
+		else
+			clt->clt_path_info = param_dup(clt, "", &path, "");
+		if (clt->clt_path_info == NULL)
+			return (-1);
+		DPRINTF("clt %d: path_info: %s", clt->clt_id,
+		    clt->clt_path_info);
+	}
 
-			continue;
-		}
+	if (query.fp_name != NULL) {
+		if ((clt->clt_query = param_dup(clt, "", &query, "")) == NULL)
+			return (-1);
+		DPRINTF("clt %d: query: %s", clt->clt_id, clt->clt_query);
+	}
 
-		fcgi->fcg_toread -= vlen;
-		evbuffer_drain(src, vlen);
+	if (method.fp_name != NULL) {
+		if (method.fp_vlen == 3 &&
+		    !strncasecmp(method.fp_val, "GET", 3))
+			clt->clt_method = METHOD_GET;
+		if (method.fp_vlen == 4 &&
+		    !strncasecmp(method.fp_val, "POST", 4))
+			clt->clt_method = METHOD_POST;
 	}
 
+	evbuffer_drain(src, fcgi->fcg_toread);
+	fcgi->fcg_toread = 0;
 	return (0);
 }
 
@@ -405,6 +689,7 @@ fcgi_read(struct bufferevent *bev, void *d)
 	struct fcgi_header	 hdr;
 	struct fcgi_begin_req	 breq;
 	struct client		*clt, q;
+	uint64_t		 start;
 	int			 role;
 
 	memset(&q, 0, sizeof(q));
@@ -413,6 +698,15 @@ fcgi_read(struct bufferevent *bev, void *d)
 		if (EVBUFFER_LENGTH(src) < (size_t)fcgi->fcg_toread)
 			return;
 
+		if (fcgi->fcg_want == FCGI_RECORD_HEADER &&
+		    (fcgi_pending(fcgi) >= FCGI_OUT_HIWAT ||
+		    fcgi->fcg_nhandled >= FCGI_HANDLED_MAX)) {
+			/* fcgi_write resumes once the output drained */
+			bufferevent_disable(bev, EV_READ);
+			fcgi->fcg_rpaused = 1;
+			return;
+		}
+
 		if (fcgi->fcg_want == FCGI_RECORD_HEADER) {
 			fcgi->fcg_want = FCGI_RECORD_BODY;
 			bufferevent_read(bev, &hdr, sizeof(hdr));
@@ -493,15 +787,25 @@ fcgi_read(struct bufferevent *bev, void *d)
 				break;
 			}
 
-			if ((clt = calloc(1, sizeof(*clt))) == NULL) {
-				log_warnx("calloc");
+			if (fcgi_nreqs >= MAX_REQUESTS) {
+				log_warnx("too many requests, rejecting %d",
+				    fcgi->fcg_rec_id);
+				if (fcgi_send_end_req(fcgi, fcgi->fcg_rec_id,
+				    1, FCGI_OVERLOADED) == -1) {
+					fcgi_error(bev, EV_READ, d);
+					return;
+				}
 				break;
 			}
 
+			if ((clt = clt_new()) == NULL)
+				break;
+
 			clt->clt_id = fcgi->fcg_rec_id;
 			clt->clt_fd = -1;
 			clt->clt_fcgi = fcgi;
 			SPLAY_INSERT(client_tree, &fcgi->fcg_clients, clt);
+			fcgi_nreqs++;
 			break;
 		case FCGI_PARAMS:
 			if (clt == NULL) {
@@ -511,16 +815,29 @@ fcgi_read(struct bufferevent *bev, void *d)
 				break;
 			}
 			if (fcgi->fcg_toread == 0) {
-				evbuffer_drain(src, fcgi->fcg_toread);
+				if (clt->clt_handled)
+					break;
+				clt->clt_handled = 1;
+				fcgi->fcg_nhandled++;
+				fcgi_busy_add(1);
 				if (server_handle(env, clt) == -1)
 					return;
 				break;
 			}
+			clt->clt_paramlen += fcgi->fcg_toread;
+			if (clt->clt_paramlen > FCGI_PARAMS_MAX) {
+				log_warnx("too many parameters for request"
+				    " %d", fcgi->fcg_rec_id);
+				fcgi_error(bev, EV_READ, d);
+				return;
+			}
+			start = stats_now();
 			if (fcgi_parse_params(fcgi, src, clt) == -1) {
 				log_warnx("fcgi_parse_params failed");
 				fcgi_error(bev, EV_READ, d);
 				return;
 			}
+			clt->clt_tparse += stats_now() - start;
 			break;
 		case FCGI_STDIN:
 			/* not interested in reading stdin */
@@ -533,15 +850,35 @@ fcgi_read(struct bufferevent *bev, void *d)
 				evbuffer_drain(src, fcgi->fcg_toread);
 				break;
 			}
+			evbuffer_drain(src, fcgi->fcg_toread);
+			if (clt->clt_done)	/* already replying */
+				break;
+			stats_count(ST_ABORTS);
+			fcgi->fcg_outlen -= EVBUFFER_LENGTH(clt->clt_out);
+			evbuffer_drain(clt->clt_out,
+			    EVBUFFER_LENGTH(clt->clt_out));
 			if (fcgi_end_request(clt, 1) == -1) {
 				/* calls fcgi_error on failure */
 				return;
 			}
 			break;
+		case FCGI_GET_VALUES:
+			if (fcgi->fcg_rec_id != 0 ||
+			    fcgi_get_values(fcgi, src) == -1) {
+				log_warnx("invalid FCGI_GET_VALUES");
+				fcgi_error(bev, EV_READ, d);
+				return;
+			}
+			break;
 		default:
 			log_warnx("unknown fastcgi record type %d",
 			    fcgi->fcg_type);
 			evbuffer_drain(src, fcgi->fcg_toread);
+			if (fcgi->fcg_rec_id == 0 &&
+			    fcgi_send_unknown(fcgi, fcgi->fcg_type) == -1) {
+				fcgi_error(bev, EV_READ, d);
+				return;
+			}
 			break;
 		}
 
@@ -552,14 +889,40 @@ fcgi_read(struct bufferevent *bev, void *d)
 	}
 }
 
+/*
+ * Refill the socket buffer and, once there's little output pending,
+ * resume the paused pages and then the reading of the requests.
+ */
 void
 fcgi_write(struct bufferevent *bev, void *d)
 {
 	struct fcgi		*fcgi = d;
 	struct evbuffer		*out = EVBUFFER_OUTPUT(bev);
+	struct client		*clt;
+
+	if (fcgi_schedule(fcgi) == -1)
+		return;
 
-	if (fcgi->fcg_done && EVBUFFER_LENGTH(out) == 0)
+	while (fcgi_pending(fcgi) < FCGI_OUT_LOWAT &&
+	    (clt = TAILQ_FIRST(&fcgi->fcg_paused)) != NULL) {
+		TAILQ_REMOVE(&fcgi->fcg_paused, clt, clt_pause);
+		clt->clt_paused = 0;
+		if (server_resume(clt) == -1)
+			return;
+	}
+
+	if (fcgi->fcg_done && EVBUFFER_LENGTH(out) == 0 &&
+	    SPLAY_EMPTY(&fcgi->fcg_clients)) {
 		fcgi_error(bev, EVBUFFER_EOF, fcgi);
+		return;
+	}
+
+	if (fcgi->fcg_rpaused && fcgi_pending(fcgi) < FCGI_OUT_LOWAT &&
+	    fcgi->fcg_nhandled < FCGI_HANDLED_MAX) {
+		fcgi->fcg_rpaused = 0;
+		bufferevent_enable(bev, EV_READ);
+		fcgi_read(bev, fcgi);
+	}
 }
 
 void
@@ -576,6 +939,7 @@ fcgi_error(struct bufferevent *bev, short event, void *d)
 	while ((clt = SPLAY_MIN(client_tree, &fcgi->fcg_clients)) != NULL) {
 		SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
 		server_client_free(clt);
+		fcgi_nreqs--;
 	}
 
 	SPLAY_REMOVE(fcgi_tree, &env->env_fcgi_socks, fcgi);
@@ -587,62 +951,303 @@ fcgi_error(struct bufferevent *bev, short event, void *d)
 void
 fcgi_free(struct fcgi *fcgi)
 {
+#if HAVE_BUFFEREVENT_SETFD
+	struct bufferevent	*bev = fcgi->fcg_bev;
+
+	if (fcgi_nfree < FCGI_FREE_MAX) {
+		bufferevent_disable(bev, EV_READ|EV_WRITE);
+		bufferevent_setfd(bev, -1);
+		evbuffer_drain(EVBUFFER_INPUT(bev),
+		    EVBUFFER_LENGTH(EVBUFFER_INPUT(bev)));
+		evbuffer_drain(EVBUFFER_OUTPUT(bev),
+		    EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)));
+		close(fcgi->fcg_s);
+		TAILQ_INSERT_HEAD(&fcgi_free_list, fcgi, fcg_free);
+		fcgi_nfree++;
+		return;
+	}
+#endif
+
 	close(fcgi->fcg_s);
 	bufferevent_free(fcgi->fcg_bev);
 	free(fcgi);
 }
 
-int
-clt_flush(struct client *clt)
+static struct client *
+clt_new(void)
+{
+	struct client		*clt;
+	struct evbuffer		*out;
+	struct arena		 arena;
+
+	if ((clt = TAILQ_FIRST(&clt_free_list)) != NULL) {
+		TAILQ_REMOVE(&clt_free_list, clt, clt_sched);
+		clt_nfree--;
+		out = clt->clt_out;
+		arena = clt->clt_arena;
+		memset(clt, 0, sizeof(*clt));
+		clt->clt_out = out;
+		clt->clt_arena = arena;
+		return (clt);
+	}
+
+	if ((clt = calloc(1, sizeof(*clt))) == NULL) {
+		log_warnx("calloc");
+		return (NULL);
+	}
+
+	if ((clt->clt_out = evbuffer_new()) == NULL) {
+		log_warnx("evbuffer_new");
+		free(clt);
+		return (NULL);
+	}
+
+	return (clt);
+}
+
+/*
+ * The parameters go away with the arena; the client, with its output
+ * buffer and the first chunk of the arena, is kept for the next one.
+ */
+void
+clt_free(struct client *clt)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	if (clt->clt_paused)
+		TAILQ_REMOVE(&fcgi->fcg_paused, clt, clt_pause);
+	if (clt->clt_handled)
+		fcgi->fcg_nhandled--;
+	if (clt->clt_handled && !clt->clt_done)
+		fcgi_busy_add(-1);
+	fcgi->fcg_outlen -= EVBUFFER_LENGTH(clt->clt_out);
+
+	arena_reset(&clt->clt_arena);
+	if (clt->clt_capture != NULL) {
+		evbuffer_free(clt->clt_capture);
+		clt->clt_capture = NULL;
+	}
+
+	if (clt_nfree < CLT_FREE_MAX) {
+		evbuffer_drain(clt->clt_out, EVBUFFER_LENGTH(clt->clt_out));
+		TAILQ_INSERT_HEAD(&clt_free_list, clt, clt_sched);
+		clt_nfree++;
+		return;
+	}
+
+	evbuffer_free(clt->clt_out);
+	arena_free(&clt->clt_arena);
+	free(clt);
+}
+
+static int
+clt_record(struct client *clt, size_t len)
 {
 	struct fcgi		*fcgi = clt->clt_fcgi;
 	struct bufferevent	*bev = fcgi->fcg_bev;
 	struct fcgi_header	 hdr;
 
-	if (clt->clt_buflen == 0)
-		return (0);
-
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.version = FCGI_VERSION_1;
 	hdr.type = FCGI_STDOUT;
 	hdr.req_id0 = (clt->clt_id & 0xFF);
 	hdr.req_id1 = (clt->clt_id >> 8);
-	hdr.content_len0 = (clt->clt_buflen & 0xFF);
-	hdr.content_len1 = (clt->clt_buflen >> 8);
+	hdr.content_len0 = (len & 0xFF);
+	hdr.content_len1 = (len >> 8);
 
-	if (bufferevent_write(bev, &hdr, sizeof(hdr)) == -1 ||
-	    bufferevent_write(bev, clt->clt_buf, clt->clt_buflen) == -1) {
-		fcgi_error(bev, EV_WRITE, fcgi);
-		return (-1);
+	if (bufferevent_write(bev, &hdr, sizeof(hdr)) == -1)
+		goto err;
+
+#if HAVE_EVBUFFER_REF
+	if (evbuffer_remove_buffer(clt->clt_out, EVBUFFER_OUTPUT(bev),
+	    len) != (int)len)
+		goto err;
+#else
+	if (bufferevent_write(bev, EVBUFFER_DATA(clt->clt_out), len) == -1)
+		goto err;
+	evbuffer_drain(clt->clt_out, len);
+#endif
+
+	fcgi->fcg_outlen -= len;
+	return (0);
+
+err:
+	fcgi_error(bev, EV_WRITE, fcgi);
+	return (-1);
+}
+
+/*
+ * The requests on a connection take turns: each one with at least a
+ * full record pending, or that is done, gets to write one record
+ * before going back to the end of the queue.  The socket buffer is
+ * only refilled when it holds less than a record, so a big reply
+ * can't hold back the others.  Returns -1 if the connection was
+ * torn down.
+ */
+static int
+fcgi_schedule(struct fcgi *fcgi)
+{
+	struct evbuffer		*out = EVBUFFER_OUTPUT(fcgi->fcg_bev);
+	struct client		*clt;
+	size_t			 len;
+
+	while (EVBUFFER_LENGTH(out) < FCGI_MAX_CONTENT &&
+	    (clt = TAILQ_FIRST(&fcgi->fcg_sched)) != NULL) {
+		TAILQ_REMOVE(&fcgi->fcg_sched, clt, clt_sched);
+		clt->clt_queued = 0;
+
+		if ((len = EVBUFFER_LENGTH(clt->clt_out)) > 0 &&
+		    clt_record(clt, MIN(len, FCGI_MAX_CONTENT)) == -1)
+			return (-1);
+
+		len = EVBUFFER_LENGTH(clt->clt_out);
+		if (len >= FCGI_MAX_CONTENT || (clt->clt_done && len > 0)) {
+			TAILQ_INSERT_TAIL(&fcgi->fcg_sched, clt, clt_sched);
+			clt->clt_queued = 1;
+			continue;
+		}
+
+		if (!clt->clt_done)
+			continue;
+
+		if (fcgi_send_end_req(fcgi, clt->clt_id, clt->clt_status,
+		    clt->clt_pstatus) == -1) {
+			fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+			return (-1);
+		}
+
+		SPLAY_REMOVE(client_tree, &fcgi->fcg_clients, clt);
+		server_client_free(clt);
+		fcgi_nreqs--;
+
+		if (!fcgi->fcg_keep_conn)
+			fcgi->fcg_done = 1;
 	}
 
-	clt->clt_buflen = 0;
+	return (0);
+}
+
+/*
+ * The output of the connection not written yet.
+ */
+static size_t
+fcgi_pending(struct fcgi *fcgi)
+{
+	return (fcgi->fcg_outlen +
+	    EVBUFFER_LENGTH(EVBUFFER_OUTPUT(fcgi->fcg_bev)));
+}
+
+static int
+clt_enqueue(struct client *clt)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	if (!clt->clt_queued) {
+		TAILQ_INSERT_TAIL(&fcgi->fcg_sched, clt, clt_sched);
+		clt->clt_queued = 1;
+	}
+	return (fcgi_schedule(fcgi));
+}
 
+/*
+ * Queue the client if it has a full record to send.
+ */
+static int
+clt_drain(struct client *clt)
+{
+	if (EVBUFFER_LENGTH(clt->clt_out) >= FCGI_MAX_CONTENT)
+		return (clt_enqueue(clt));
+	return (0);
+}
+
+static void
+clt_capture(struct client *clt, const void *buf, size_t len)
+{
+	if (clt->clt_capture != NULL &&
+	    evbuffer_add(clt->clt_capture, buf, len) == -1) {
+		/* not fatal, just don't cache this reply */
+		evbuffer_free(clt->clt_capture);
+		clt->clt_capture = NULL;
+	}
+}
+
+int
+clt_flush(struct client *clt)
+{
+	if (EVBUFFER_LENGTH(clt->clt_out) > 0 || clt->clt_done)
+		return (clt_enqueue(clt));
 	return (0);
 }
 
+/*
+ * Whether the connection of the client has too much output pending
+ * and the rendering should pause.
+ */
+int
+clt_congested(struct client *clt)
+{
+	return (fcgi_pending(clt->clt_fcgi) >= FCGI_OUT_HIWAT);
+}
+
+/*
+ * Have server_resume called once the output drained.  What the client
+ * has so far is queued, so that there's something to write.
+ */
+int
+clt_pause(struct client *clt)
+{
+	struct fcgi		*fcgi = clt->clt_fcgi;
+
+	if (!clt->clt_paused) {
+		TAILQ_INSERT_TAIL(&fcgi->fcg_paused, clt, clt_pause);
+		clt->clt_paused = 1;
+	}
+	return (clt_flush(clt));
+}
+
 int
 clt_write(struct client *clt, const uint8_t *buf, size_t len)
 {
-	size_t			 left, copy;
+	struct fcgi		*fcgi = clt->clt_fcgi;
 
-	while (len > 0) {
-		left = sizeof(clt->clt_buf) - clt->clt_buflen;
-		if (left == 0) {
-			if (clt_flush(clt) == -1)
-				return (-1);
-			left = sizeof(clt->clt_buf);
-		}
+	clt_capture(clt, buf, len);
+	clt->clt_bytes += len;
+
+	if (evbuffer_add(clt->clt_out, buf, len) == -1) {
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
+	}
+	fcgi->fcg_outlen += len;
+
+	return (clt_drain(clt));
+}
+
+/*
+ * Like clt_write, but buf is known to outlive the request, as the
+ * templates do, and may be queued without copying it.
+ */
+int
+clt_putref(struct client *clt, const void *buf, size_t len)
+{
+#if HAVE_EVBUFFER_REF
+	struct fcgi		*fcgi = clt->clt_fcgi;
 
-		copy = MIN(left, len);
+	if (len < CLT_REF_MIN)
+		return (clt_write(clt, buf, len));
 
-		memcpy(&clt->clt_buf[clt->clt_buflen], buf, copy);
-		clt->clt_buflen += copy;
-		buf += copy;
-		len -= copy;
+	clt_capture(clt, buf, len);
+	clt->clt_bytes += len;
+
+	if (evbuffer_add_reference(clt->clt_out, buf, len, NULL, NULL) == -1) {
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
 	}
+	fcgi->fcg_outlen += len;
 
-	return (0);
+	return (clt_drain(clt));
+#else
+	return (clt_write(clt, buf, len));
+#endif
 }
 
 int
@@ -660,60 +1265,156 @@ clt_puts(struct client *clt, const char *str)
 int
 clt_write_bufferevent(struct client *clt, struct bufferevent *bev)
 {
+	struct fcgi		*fcgi = clt->clt_fcgi;
 	struct evbuffer		*src = EVBUFFER_INPUT(bev);
-	size_t			 len, left, copy;
+	size_t			 len = EVBUFFER_LENGTH(src);
 
-	len = EVBUFFER_LENGTH(src);
-	while (len > 0) {
-		left = sizeof(clt->clt_buf) - clt->clt_buflen;
-		if (left == 0) {
-			if (clt_flush(clt) == -1)
-				return (-1);
-			left = sizeof(clt->clt_buf);
-		}
-
-		copy = bufferevent_read(bev, &clt->clt_buf[clt->clt_buflen],
-		    MIN(left, len));
-		clt->clt_buflen += copy;
+	if (clt->clt_capture != NULL) {
+		evbuffer_free(clt->clt_capture);
+		clt->clt_capture = NULL;
+	}
 
-		len = EVBUFFER_LENGTH(src);
+	if (evbuffer_add_buffer(clt->clt_out, src) == -1) {
+		fcgi_error(fcgi->fcg_bev, EV_WRITE, fcgi);
+		return (-1);
 	}
+	fcgi->fcg_outlen += len;
+
+	return (clt_drain(clt));
+}
 
+/*
+ * Return the length of the initial run of s that doesn't need to be
+ * escaped, that is without any of <>&"' and, if nl is set, newlines.
+ * Long strings are scanned a block at a time; when the compiler
+ * doesn't target SSE2 or AVX2 eight bytes are tested at once in a
+ * plain 64 bit word.
+ */
+#define HTML_SPECIAL(c, nl)	((c) == '<' || (c) == '>' || (c) == '&' || \
+				    (c) == '"' || (c) == '\'' || \
+				    ((nl) && (c) == '\n'))
+
+#if defined(__AVX2__)
+#define HTML_BLOCK	32
+static inline unsigned int
+html_block(const char *s, int nl)
+{
+	__m256i	v, m;
+
+	v = _mm256_loadu_si256((const __m256i *)s);
+	m = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>'))),
+	    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+	if (nl)
+		m = _mm256_or_si256(m,
+		    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+	return (_mm256_movemask_epi8(m));
+}
+#elif defined(__SSE2__)
+#define HTML_BLOCK	16
+static inline unsigned int
+html_block(const char *s, int nl)
+{
+	__m128i	v, m;
+
+	v = _mm_loadu_si128((const __m128i *)s);
+	m = _mm_or_si128(
+	    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+	    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+	if (nl)
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	return (_mm_movemask_epi8(m));
+}
+#else
+#define HTML_BLOCK	8
+#define ONES		0x0101010101010101ULL
+#define HIGHS		0x8080808080808080ULL
+#define HASZERO(x)	(((x) - ONES) & ~(x) & HIGHS)
+#define HASBYTE(x, c)	HASZERO((x) ^ (ONES * (unsigned char)(c)))
+
+/* only tells whether there is something to escape, not where */
+static inline unsigned int
+html_block(const char *s, int nl)
+{
+	uint64_t	x;
+
+	memcpy(&x, s, sizeof(x));
+	if (HASBYTE(x, '<') || HASBYTE(x, '>') || HASBYTE(x, '&') ||
+	    HASBYTE(x, '"') || HASBYTE(x, '\'') || (nl && HASBYTE(x, '\n')))
+		return (1);
 	return (0);
 }
+#endif
+
+static size_t
+html_span(const char *s, size_t len, int nl)
+{
+	size_t		 i = 0;
+	unsigned int	 m;
+
+	for (; i + HTML_BLOCK <= len; i += HTML_BLOCK) {
+		if ((m = html_block(s + i, nl)) == 0)
+			continue;
+#if HTML_BLOCK != 8
+		return (i + __builtin_ctz(m));
+#else
+		break;
+#endif
+	}
+
+	for (; i < len; ++i)
+		if (HTML_SPECIAL(s[i], nl))
+			break;
+	return (i);
+}
+
+static const char *
+html_entity(char c)
+{
+	switch (c) {
+	case '<':
+		return ("&lt;");
+	case '>':
+		return ("&gt;");
+	case '&':
+		return ("&amp;");
+	case '"':
+		return ("&quot;");
+	case '\'':
+		return ("&apos;");
+	default:
+		return (NULL);
+	}
+}
 
 int
 clt_putsan(struct client *clt, const char *s)
 {
-	int	r;
+	size_t	len, n;
 
 	if (s == NULL)
 		return (0);
 
-	for (; *s; ++s) {
-		switch (*s) {
-		case '<':
-			r = clt_puts(clt, "&lt;");
-			break;
-		case '>':
-			r = clt_puts(clt, "&gt;");
-			break;
-		case '&':
-			r = clt_puts(clt, "&amp;");
-			break;
-		case '"':
-			r = clt_puts(clt, "&quot;");
-			break;
-		case '\'':
-			r = clt_puts(clt, "&apos;");
-			break;
-		default:
-			r = clt_putc(clt, *s);
+	len = strlen(s);
+	for (;;) {
+		n = html_span(s, len, 0);
+		if (n != 0 && clt_write(clt, s, n) == -1)
+			return (-1);
+		s += n;
+		len -= n;
+		if (len == 0)
 			break;
-		}
 
-		if (r == -1)
+		if (clt_puts(clt, html_entity(*s)) == -1)
 			return (-1);
+		s++;
+		len--;
 	}
 
 	return (0);
@@ -722,12 +1423,25 @@ clt_putsan(struct client *clt, const char *s)
 int
 clt_putmatch(struct client *clt, const char *s)
 {
-	int	r, instrong = 0, intag = 0, lastnl = 0;
+	size_t	len, n;
+	int	r = 0, instrong = 0, intag = 0, lastnl = 0;
 
 	if (s == NULL)
 		return (0);
 
-	for (; *s; ++s) {
+	len = strlen(s);
+	for (;;) {
+		n = html_span(s, len, 1);
+		if (n != 0) {
+			lastnl = 0;
+			if (clt_write(clt, s, n) == -1)
+				return (-1);
+		}
+		s += n;
+		len -= n;
+		if (len == 0)
+			break;
+
 		switch (*s) {
 		case '<':
 			if (!instrong && !strncmp(s, "<strong>", 8)) {
@@ -747,15 +1461,6 @@ clt_putmatch(struct client *clt, const char *s)
 			} else
 				r = clt_puts(clt, "&gt;");
 			break;
-		case '&':
-			r = clt_puts(clt, "&amp;");
-			break;
-		case '"':
-			r = clt_puts(clt, "&quot;");
-			break;
-		case '\'':
-			r = clt_puts(clt, "&apos;");
-			break;
 		case '\n':
 			if (lastnl)
 				break;
@@ -763,13 +1468,14 @@ clt_putmatch(struct client *clt, const char *s)
 			lastnl = 1;
 			break;
 		default:
-			lastnl = 0;
-			r = clt_putc(clt, *s);
+			r = clt_puts(clt, html_entity(*s));
 			break;
 		}
 
 		if (r == -1)
 			return (-1);
+		s++;
+		len--;
 	}
 
 	if (instrong)		/* something went wrong... */
@@ -777,25 +1483,213 @@ clt_putmatch(struct client *clt, const char *s)
 	return (0);
 }
 
+/*
+ * Length of the UTF-8 sequence at the start of s, or 0 if it's not a
+ * valid one: truncated, overlong, a surrogate or beyond U+10FFFF.
+ */
+static size_t
+utf8_seq(const unsigned char *s, size_t len)
+{
+	uint32_t	 cp;
+	size_t		 i, n;
+
+	if (s[0] < 0x80)
+		return (1);
+	if ((s[0] & 0xE0) == 0xC0) {
+		n = 2;
+		cp = s[0] & 0x1F;
+	} else if ((s[0] & 0xF0) == 0xE0) {
+		n = 3;
+		cp = s[0] & 0x0F;
+	} else if ((s[0] & 0xF8) == 0xF0) {
+		n = 4;
+		cp = s[0] & 0x07;
+	} else
+		return (0);
+
+	if (n > len)
+		return (0);
+	for (i = 1; i < n; ++i) {
+		if ((s[i] & 0xC0) != 0x80)
+			return (0);
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+
+	if ((n == 2 && cp < 0x80) || (n == 3 && cp < 0x800) ||
+	    (n == 4 && cp < 0x10000) || (cp >= 0xD800 && cp <= 0xDFFF) ||
+	    cp > 0x10FFFF)
+		return (0);
+	return (n);
+}
+
+/*
+ * Return the length of the initial run of s that can be copied as is
+ * in a JSON string.  It also stops at '<' if lt is set.
+ */
+static size_t
+json_span(const char *s, size_t len, int lt)
+{
+	const unsigned char	*u = (const unsigned char *)s;
+	size_t			 i, n;
+
+	for (i = 0; i < len; i += n) {
+		n = 1;
+		if (u[i] >= 0x80) {
+			if ((n = utf8_seq(u + i, len - i)) == 0)
+				break;
+		} else if (u[i] < 0x20 || u[i] == '"' || u[i] == '\\' ||
+		    (lt && u[i] == '<'))
+			break;
+	}
+	return (i);
+}
+
+/*
+ * Write the escape for c, where json_span stopped, and set dlen to the
+ * length it has once decoded: bytes that aren't valid UTF-8 become
+ * U+FFFD.
+ */
+static int
+json_escape(struct client *clt, char c, size_t *dlen)
+{
+	*dlen = 1;
+	switch (c) {
+	case '"':
+		return (clt_puts(clt, "\\\""));
+	case '\\':
+		return (clt_puts(clt, "\\\\"));
+	case '\n':
+		return (clt_puts(clt, "\\n"));
+	case '\r':
+		return (clt_puts(clt, "\\r"));
+	case '\t':
+		return (clt_puts(clt, "\\t"));
+	case '<':
+		return (clt_putc(clt, c));
+	}
+
+	if ((unsigned char)c < 0x20)
+		return (clt_printf(clt, "\\u%04x", (unsigned char)c));
+
+	*dlen = 3;
+	return (clt_puts(clt, "\\ufffd"));
+}
+
+/*
+ * Write s as a JSON string, or null.
+ */
+int
+clt_putjson(struct client *clt, const char *s)
+{
+	size_t	len, n, dlen;
+
+	if (s == NULL)
+		return (clt_puts(clt, "null"));
+
+	if (clt_putc(clt, '"') == -1)
+		return (-1);
+
+	len = strlen(s);
+	for (;;) {
+		n = json_span(s, len, 0);
+		if (n != 0 && clt_write(clt, s, n) == -1)
+			return (-1);
+		s += n;
+		len -= n;
+		if (len == 0)
+			break;
+
+		if (json_escape(clt, *s, &dlen) == -1)
+			return (-1);
+		s++;
+		len--;
+	}
+
+	return (clt_putc(clt, '"'));
+}
+
+/*
+ * Like clt_putjson, for the excerpts: the <strong> tags around the
+ * matches are left out and their position in the decoded string is
+ * saved in m instead, up to *nm of them.  *nm is set to how many
+ * there are.
+ */
+int
+clt_putjsonmatch(struct client *clt, const char *s, struct span *m,
+    size_t *nm)
+{
+	size_t	len, n, dlen, off = 0, max = *nm;
+	int	instrong = 0;
+
+	*nm = 0;
+	if (s == NULL)
+		return (clt_puts(clt, "null"));
+
+	if (clt_putc(clt, '"') == -1)
+		return (-1);
+
+	len = strlen(s);
+	for (;;) {
+		n = json_span(s, len, 1);
+		if (n != 0 && clt_write(clt, s, n) == -1)
+			return (-1);
+		s += n;
+		len -= n;
+		off += n;
+		if (len == 0)
+			break;
+
+		if (!instrong && !strncmp(s, "<strong>", 8)) {
+			instrong = 1;
+			if (*nm < max)
+				m[*nm].sp_off = off;
+			n = 8;
+		} else if (instrong && !strncmp(s, "</strong>", 9)) {
+			instrong = 0;
+			if (*nm < max) {
+				m[*nm].sp_len = off - m[*nm].sp_off;
+				(*nm)++;
+			}
+			n = 9;
+		} else {
+			if (json_escape(clt, *s, &dlen) == -1)
+				return (-1);
+			off += dlen;
+			n = 1;
+		}
+		s += n;
+		len -= n;
+	}
+
+	return (clt_putc(clt, '"'));
+}
+
 int
 clt_printf(struct client *clt, const char *fmt, ...)
 {
 	struct fcgi		*fcgi = clt->clt_fcgi;
 	struct bufferevent	*bev = fcgi->fcg_bev;
-	char			*str;
+	char			 buf[256], *str = buf;
 	va_list			 ap;
 	int			 r;
 
+	/* most fit in buf, the others are allocated */
 	va_start(ap, fmt);
-	r = vasprintf(&str, fmt, ap);
+	r = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
+	if (r >= 0 && (size_t)r >= sizeof(buf)) {
+		va_start(ap, fmt);
+		r = vasprintf(&str, fmt, ap);
+		va_end(ap);
+	}
 	if (r == -1) {
 		fcgi_error(bev, EV_WRITE, fcgi);
 		return (-1);
 	}
 
 	r = clt_write(clt, str, r);
-	free(str);
+	if (str != buf)
+		free(str);
 	return (r);
 }
 
@@ -2,6 +2,8 @@
  * This file is in the public domain.
  */
 
+#include <sys/mman.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/tree.h>
@@ -14,6 +16,7 @@
 #include <event.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <paths.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -21,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -42,46 +46,110 @@
 #define MSEARCH_TMPL_DIR SYSCONFDIR "/smarc"
 #endif
 
-#define MAX_CHILDREN 32
+#define MAX_CACHE 4096
+#define MAX_SHCACHE (1024 * 1024)	/* KiB */
+#define MAX_TIMEOUT (60 * 1000)	/* msec */
+#define MAX_HALFLIFE (100 * 365)	/* days */
+#define MAX_BACKLOG 65535
+#define MAX_DBCACHE (1024 * 1024)	/* KiB */
+#define MAX_MMAP (64 * 1024)		/* MiB */
+
+#define MAX_BACKOFF	60	/* seconds */
+#define BACKOFF_RESET	60	/* seconds a child must live to reset it */
+#define SCALE_COOLDOWN	5	/* seconds between scaling events */
+#define SCALE_IDLE	30	/* seconds of low load before scaling down */
+
+enum {
+	CHILD_FREE,
+	CHILD_STARTING,		/* asked to the spawner */
+	CHILD_RUNNING,
+	CHILD_RETIRING,		/* finishing its connections */
+	CHILD_BACKOFF,		/* waiting to be restarted */
+};
+
+struct child {
+	pid_t		 c_pid;
+	int		 c_state;
+	int		 c_turnfd;	/* to hand it the turn to accept */
+	time_t		 c_started;
+	int		 c_backoff;	/* seconds */
+	struct event	 c_respawn;
+};
+
+/* between the supervisor and the spawner */
+enum {
+	SPAWN_START,		/* slot */
+	SPAWN_KILL,		/* slot, signal */
+	SPAWN_STARTED,		/* slot, pid */
+	SPAWN_EXITED,		/* slot, wait status */
+};
+
+struct spawn_msg {
+	int		 sm_type;
+	int		 sm_slot;
+	int		 sm_arg;
+};
+
+/* what the children are started with */
+struct spawn {
+	const char	*sp_argv0;
+	char		 sp_path[PATH_MAX];	/* of the program */
+	const char	*sp_root;
+	const char	*sp_user;
+	const char	*sp_db;
+	const char	*sp_tmpl;
+	const char	*sp_searches;	/* to warm up with, if any */
+	struct passwd	*sp_pw;
+	int		 sp_sockfd;
+	int		 sp_shfd;
+	int		 sp_stfd;
+	int		 sp_turnfd;	/* where the turn is given back */
+};
 
 int	debug;
 int	verbose;
 int	children = 3;
-pid_t	pids[MAX_CHILDREN];
-
-const char	*tmpl_head;
-const char	*tmpl_search;
-const char	*tmpl_search_header;
-const char	*tmpl_foot;
-
-static void
-sighdlr(int sig)
-{
-	static volatile sig_atomic_t got_sig;
-	int	i, save_errno;
-
-	if (got_sig)
-		return;
-	got_sig = -1;
-
-	save_errno = errno;
-	for (i = 0; i < children; ++i)
-		(void)kill(pids[i], SIGTERM);
-	errno = save_errno;
-}
-
-static void
-load_tmpl(const char **ret, const char *dir, const char *name)
+int	max_children;
+int	backlog = 128;
+int	accept_serial;
+int	expose_stats;
+int	prefork;
+int	cache_size = 64;
+int	shcache_kb = 8192;
+int	dbcache_kb;
+int	mmap_mb;
+int	warmup;
+char	*warmup_searches;
+int	workers = 2;
+int	query_timeout = 1000;
+double	rank_weights[RANK_NCOLS] = { 1.0, 1.0, 1.0 };
+int	rank_halflife;
+
+static struct spawn	 spawn;
+static struct child	 kids[MAX_CHILDREN];
+static int		 turn = -1;	/* child accepting, if any */
+static int		 turn_in = -1;	/* where the turn is given back */
+static int		 spawn_fd = -1;	/* to the other of the two */
+static pid_t		 spawned[MAX_CHILDREN];	/* by the spawner */
+static int		 turn_rd[MAX_CHILDREN];	/* for the children */
+static struct event_base *spawner_base;
+static int		 shutting_down;
+static double		 load;
+static time_t		 last_scale;
+static int		 idle_secs;
+
+struct template	*tmpl_head;
+struct template	*tmpl_search;
+struct template	*tmpl_search_header;
+struct template	*tmpl_search_result;
+struct template	*tmpl_foot;
+
+static char *
+read_file(const char *path)
 {
 	FILE		*fp;
 	struct stat	 sb;
 	char		*t;
-	char		 path[PATH_MAX];
-	int		 r;
-
-	r = snprintf(path, sizeof(path), "%s/%s", dir, name);
-	if (r < 0 || (size_t)r >= sizeof(path))
-		fatalx("path too long: %s/%s", dir, name);
 
 	if ((fp = fopen(path, "r")) == NULL)
 		fatal("can't open %s", path);
@@ -101,7 +169,34 @@ load_tmpl(const char **ret, const char *dir, const char *name)
 	fclose(fp);
 
 	t[sb.st_size] = '\0';
-	*ret = t;
+	return (t);
+}
+
+static void
+load_tmpl(struct template **ret, const char *dir, const char *name,
+    unsigned int vars)
+{
+	char		 path[PATH_MAX];
+	int		 r;
+
+	r = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		fatalx("path too long: %s/%s", dir, name);
+
+	if ((*ret = tmpl_compile(read_file(path), vars)) == NULL)
+		fatal("can't compile template %s", path);
+}
+
+static void
+load_templates(const char *dir)
+{
+	load_tmpl(&tmpl_head, dir, "head.html", TMPL_VAR(TV_TITLE));
+	load_tmpl(&tmpl_search, dir, "search.html", TMPL_VAR(TV_QUERY));
+	load_tmpl(&tmpl_search_header, dir, "search-header.html", 0);
+	load_tmpl(&tmpl_search_result, dir, "search-result.html",
+	    TMPL_VAR(TV_DATE) | TMPL_VAR(TV_FROM) | TMPL_VAR(TV_MID) |
+	    TMPL_VAR(TV_SUBJECT) | TMPL_VAR(TV_EXCERPT));
+	load_tmpl(&tmpl_foot, dir, "foot.html", 0);
 }
 
 static int
@@ -154,7 +249,7 @@ bind_socket(const char *path, struct passwd *pw)
 		return (-1);
 	}
 
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, backlog) == -1) {
 		log_warn("%s: listen", __func__);
 		close(fd);
 		(void)unlink(path);
@@ -164,54 +259,790 @@ bind_socket(const char *path, struct passwd *pw)
 	return (fd);
 }
 
-static pid_t
-start_child(const char *argv0, const char *root, const char *user,
-    const char *db, const char *tmpl, int debug, int verbose, int fd)
+/*
+ * Create an anonymous shared memory segment, filled with zeroes,
+ * which is inherited by the children.
+ */
+static int
+shm_create(const char *name, size_t size)
 {
-	const char	*argv[13];
+	char		 path[64];
+	int		 fd, r;
+
+	r = snprintf(path, sizeof(path), "/msearchd.%lld.%s",
+	    (long long)getpid(), name);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		fatalx("%s: path too long", __func__);
+
+	if ((fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0600)) == -1)
+		fatal("shm_open %s", path);
+	if (shm_unlink(path) == -1)
+		fatal("shm_unlink %s", path);
+
+	if (ftruncate(fd, size) == -1)
+		fatal("ftruncate");
+
+	return (fd);
+}
+
+static int
+shcache_create(size_t size)
+{
+	void		*seg;
+	int		 fd;
+
+	fd = shm_create("cache", size);
+	seg = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED)
+		fatal("mmap");
+	shcache_format(seg, size);
+	munmap(seg, size);
+
+	return (fd);
+}
+
+/*
+ * Move fd out of the way of those set up in the children, so that
+ * doing it doesn't clobber any.
+ */
+static int
+fd_high(int fd)
+{
+	int		 nfd;
+
+	if ((nfd = fcntl(fd, F_DUPFD_CLOEXEC, ACCEPT_OUT_FD + 1)) == -1)
+		fatal("fcntl");
+	close(fd);
+	return (nfd);
+}
+
+static void
+setup_fd(int fd, int want, const char *what)
+{
+	if (fd != want) {
+		if (dup2(fd, want) == -1)
+			fatal("cannot setup %s fd", what);
+	} else if (fcntl(fd, F_SETFD, 0) == -1)
+		fatal("cannot setup %s fd", what);
+}
+
+static void
+drop_privileges(const char *root, struct passwd *pw)
+{
+	if (chroot(root) == -1)
+		fatal("chroot %s", root);
+	if (chdir("/") == -1)
+		fatal("chdir /");
+
+	if (setgroups(1, &pw->pw_gid) == -1 ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) == -1 ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) == -1)
+		fatal("failed to drop privileges");
+}
+
+static int
+child_main(const char *root, struct passwd *pw, const char *db, int slot)
+{
+	setproctitle("server");
+	drop_privileges(root, pw);
+	return (server_main(db, slot));
+}
+
+static void
+spawn_send(int type, int slot, int arg)
+{
+	struct spawn_msg	 msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.sm_type = type;
+	msg.sm_slot = slot;
+	msg.sm_arg = arg;
+	if (write(spawn_fd, &msg, sizeof(msg)) != sizeof(msg))
+		fatal("%s: write", __func__);
+}
+
+/*
+ * Read a message from the other process into msg.  Returns 0 at EOF,
+ * -1 if there's nothing to read yet.
+ */
+static int
+spawn_recv(int fd, struct spawn_msg *msg)
+{
+	ssize_t		 n;
+
+	if ((n = read(fd, msg, sizeof(*msg))) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (-1);
+		fatal("%s: read", __func__);
+	}
+	if (n == 0)
+		return (0);
+	if (n != sizeof(*msg) || msg->sm_slot < 0 ||
+	    msg->sm_slot >= max_children)
+		fatalx("%s: bad message", __func__);
+	return (1);
+}
+
+/*
+ * With -f the children are forked without executing msearchd again,
+ * so they share with the spawner the templates and the pages of the
+ * program and libraries it already touched.  It already chrooted and
+ * dropped privileges.  Close what exec would have.
+ */
+static void __dead
+fork_child(int slot)
+{
+	int		 i;
+
+	close(spawn_fd);
+	close(spawn.sp_sockfd);
+	if (spawn.sp_shfd != -1)
+		close(spawn.sp_shfd);
+	close(spawn.sp_stfd);
+	if (accept_serial) {
+		for (i = 0; i < max_children; ++i)
+			close(turn_rd[i]);
+		close(spawn.sp_turnfd);
+	}
+
+	setproctitle("server");
+	exit(server_main(spawn.sp_db, slot));
+}
+
+/*
+ * Start the child for slot on behalf of the supervisor.  The turns
+ * to accept left in its pipe by the previous one are thrown away, or
+ * it would accept out of turn.
+ */
+static void
+spawn_child(int slot)
+{
+	const char	*argv[36];
+	char		 buf[64];
+	char		 csize[16], shsize[16], nworkers[16], timeout[16];
+	char		 nslot[16], weights[64], halflife[16];
+	char		 dbcache[16], mmapsz[16];
 	int		 argc = 0;
 	pid_t		 pid;
 
+	if (accept_serial)
+		while (read(turn_rd[slot], buf, sizeof(buf)) > 0)
+			/* nop */ ;
+
 	switch (pid = fork()) {
 	case -1:
 		fatal("cannot fork");
 	case 0:
 		break;
 	default:
-		close(fd);
-		return (pid);
+		spawned[slot] = pid;
+		spawn_send(SPAWN_STARTED, slot, pid);
+		return;
 	}
 
-	if (fd != 3) {
-		if (dup2(fd, 3) == -1)
-			fatal("cannot setup socket fd");
-	} else if (fcntl(fd, F_SETFD, 0) == -1)
-		fatal("cannot setup socket fd");
+	/*
+	 * Give the event base of the spawner its own backend, so that
+	 * freeing it doesn't remove the events of the spawner from the
+	 * shared one, before setup_fd clobbers its descriptors.  This
+	 * also restores the signal handlers.
+	 */
+	if (prefork) {
+		if (event_reinit(spawner_base) == -1)
+			fatalx("event_reinit");
+		event_base_free(spawner_base);
+	}
 
-	argv[argc++] = argv0;
-	argv[argc++] = "-S";
-	argv[argc++] = "-p"; argv[argc++] = root;
-	argv[argc++] = "-t"; argv[argc++] = tmpl;
-	argv[argc++] = "-u"; argv[argc++] = user;
+	setup_fd(spawn.sp_sockfd, 3, "socket");
+	if (spawn.sp_shfd != -1)
+		setup_fd(spawn.sp_shfd, SHCACHE_FD, "shared cache");
+	setup_fd(spawn.sp_stfd, STATS_FD, "stats");
+	if (accept_serial) {
+		setup_fd(turn_rd[slot], ACCEPT_IN_FD, "accept turn");
+		setup_fd(spawn.sp_turnfd, ACCEPT_OUT_FD, "accept turn");
+	}
+
+	if (prefork)
+		fork_child(slot);
+
+	(void)snprintf(nslot, sizeof(nslot), "%d", slot);
+	(void)snprintf(csize, sizeof(csize), "%d", cache_size);
+	(void)snprintf(shsize, sizeof(shsize), "%d", shcache_kb);
+	(void)snprintf(nworkers, sizeof(nworkers), "%d", workers);
+	(void)snprintf(timeout, sizeof(timeout), "%d", query_timeout);
+	(void)snprintf(weights, sizeof(weights), "%g,%g,%g", rank_weights[0],
+	    rank_weights[1], rank_weights[2]);
+	(void)snprintf(halflife, sizeof(halflife), "%d", rank_halflife);
+	(void)snprintf(dbcache, sizeof(dbcache), "%d", dbcache_kb);
+	(void)snprintf(mmapsz, sizeof(mmapsz), "%d", mmap_mb);
+
+	argv[argc++] = spawn.sp_argv0;
+	argv[argc++] = "-S"; argv[argc++] = nslot;
+	argv[argc++] = "-b"; argv[argc++] = weights;
+	argv[argc++] = "-C"; argv[argc++] = dbcache;
+	argv[argc++] = "-c"; argv[argc++] = csize;
+	argv[argc++] = "-l"; argv[argc++] = timeout;
+	argv[argc++] = "-M"; argv[argc++] = mmapsz;
+	argv[argc++] = "-m"; argv[argc++] = shsize;
+	argv[argc++] = "-p"; argv[argc++] = spawn.sp_root;
+	argv[argc++] = "-r"; argv[argc++] = halflife;
+	argv[argc++] = "-t"; argv[argc++] = spawn.sp_tmpl;
+	argv[argc++] = "-u"; argv[argc++] = spawn.sp_user;
+	argv[argc++] = "-w"; argv[argc++] = nworkers;
+	if (spawn.sp_searches != NULL) {
+		argv[argc++] = "-Q";
+		argv[argc++] = spawn.sp_searches;
+	}
+	if (warmup)
+		argv[argc++] = "-W";
+	if (accept_serial)
+		argv[argc++] = "-a";
+	if (expose_stats)
+		argv[argc++] = "-e";
 	if (debug)
 		argv[argc++] = "-d";
-	if (verbose--)
+	if (verbose > 0)
 		argv[argc++] = "-v";
-	if (verbose--)
+	if (verbose > 1)
 		argv[argc++] = "-v";
-	argv[argc++] = db;
+	argv[argc++] = spawn.sp_db;
 	argv[argc++] = NULL;
 
 	/* obnoxious cast */
-	execvp(argv0, (char * const *) argv);
-	fatal("execvp %s", argv0);
+	execv(spawn.sp_path, (char * const *) argv);
+	fatal("execv %s", spawn.sp_path);
+}
+
+static void
+spawner_dispatch(int fd, short ev, void *arg)
+{
+	struct spawn_msg	 msg;
+	int			 i, r, slot;
+
+	if ((r = spawn_recv(fd, &msg)) == -1)
+		return;
+	if (r == 0) {
+		/* the supervisor is gone */
+		for (i = 0; i < max_children; ++i)
+			if (spawned[i] != 0)
+				(void)kill(spawned[i], SIGTERM);
+		exit(0);
+	}
+
+	slot = msg.sm_slot;
+	switch (msg.sm_type) {
+	case SPAWN_START:
+		if (spawned[slot] != 0)
+			fatalx("%s: child %d is already running", __func__,
+			    slot);
+		spawn_child(slot);
+		break;
+	case SPAWN_KILL:
+		if (msg.sm_arg != SIGTERM && msg.sm_arg != SIGUSR1)
+			fatalx("%s: bad signal %d", __func__, msg.sm_arg);
+		/* not yet waited for, so the pid can't be reused */
+		if (spawned[slot] != 0 &&
+		    kill(spawned[slot], msg.sm_arg) == -1)
+			log_warn("kill %lld", (long long)spawned[slot]);
+		break;
+	default:
+		fatalx("%s: unexpected message %d", __func__, msg.sm_type);
+	}
+}
+
+static void
+spawner_sig_handler(int sig, short ev, void *arg)
+{
+	int		 i, status;
+	pid_t		 pid;
+
+	switch (sig) {
+	case SIGCHLD:
+		while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0) {
+			for (i = 0; i < max_children; ++i)
+				if (spawned[i] == pid)
+					break;
+			if (i == max_children)
+				continue;
+			spawned[i] = 0;
+			spawn_send(SPAWN_EXITED, i, status);
+		}
+		break;
+	case SIGINT:
+	case SIGTERM:
+		/* the supervisor stops the children */
+		break;
+	default:
+		fatalx("unexpected signal %d", sig);
+	}
+}
+
+/*
+ * With -f the children are forked as they will run, so the spawner
+ * chroots and drops privileges first, and warms up the database once
+ * for all of them.  The connection is closed before forking: SQLite
+ * ones can't be shared with a child, but the buffer cache is.
+ */
+static void
+prefork_setup(void)
+{
+	drop_privileges(spawn.sp_root, spawn.sp_pw);
+
+	if (warmup || warmup_searches != NULL) {
+		if (realpath(spawn.sp_db, dbpath) == NULL)
+			fatal("realpath %s", spawn.sp_db);
+		server_warmup();
+		warmup = 0;
+	}
+
+	/* the children inherit it and pledge what server_main needs */
+	if (pledge("stdio rpath wpath cpath flock unix proc unveil",
+	    NULL) == -1)
+		fatal("pledge");
+}
+
+/*
+ * Find the program like execvp would, once and for all, so that the
+ * spawner can be restricted to executing it.  path has PATH_MAX bytes.
+ */
+static void
+find_self(const char *argv0, char *path)
+{
+	char		 buf[PATH_MAX], *dirs, *dir, *s;
+	int		 r;
+
+	if (strchr(argv0, '/') != NULL) {
+		if (realpath(argv0, path) == NULL)
+			fatal("realpath %s", argv0);
+		return;
+	}
+
+	if ((s = getenv("PATH")) == NULL || *s == '\0')
+		s = _PATH_DEFPATH;
+	if ((dirs = strdup(s)) == NULL)
+		fatal("strdup");
+
+	s = dirs;
+	while ((dir = strsep(&s, ":")) != NULL) {
+		r = snprintf(buf, sizeof(buf), "%s/%s",
+		    *dir != '\0' ? dir : ".", argv0);
+		if (r < 0 || (size_t)r >= sizeof(buf))
+			continue;
+		if (access(buf, X_OK) == 0 && realpath(buf, path) != NULL) {
+			free(dirs);
+			return;
+		}
+	}
+	fatalx("%s not found in PATH", argv0);
+}
+
+/*
+ * The spawner keeps the privileges needed to start the children, and
+ * only starts and signals them when the supervisor asks.  Without -f
+ * it keeps running as root, since the children it executes need it to
+ * chroot, but may only execute msearchd again.
+ */
+static void __dead
+spawner_main(void)
+{
+	struct event	 ev, sigchld, sigint, sigterm;
+
+	setproctitle("spawner");
+	spawner_base = event_init();
+
+	signal_set(&sigchld, SIGCHLD, spawner_sig_handler, NULL);
+	signal_set(&sigint, SIGINT, spawner_sig_handler, NULL);
+	signal_set(&sigterm, SIGTERM, spawner_sig_handler, NULL);
+	signal_add(&sigchld, NULL);
+	signal_add(&sigint, NULL);
+	signal_add(&sigterm, NULL);
+
+	event_set(&ev, spawn_fd, EV_READ|EV_PERSIST, spawner_dispatch, NULL);
+	event_add(&ev, NULL);
+
+	if (prefork)
+		prefork_setup();
+	else {
+		if (unveil(spawn.sp_path, "x") == -1)
+			fatal("unveil(%s, x)", spawn.sp_path);
+		if (unveil(NULL, NULL) == -1)
+			fatal("unveil");
+		/* exec: to start the children */
+		if (pledge("stdio proc exec", NULL) == -1)
+			fatal("pledge");
+	}
+
+	event_dispatch();
+	fatalx("spawner: event loop exited");
+}
+
+static void
+start_child(int slot)
+{
+	struct child	*c = &kids[slot];
+
+	c->c_state = CHILD_STARTING;
+	c->c_started = time(NULL);
+	spawn_send(SPAWN_START, slot, 0);
+}
+
+/*
+ * Hand the turn to accept to the next running child after the given
+ * one, or to nobody if there's none.
+ */
+static void
+turn_next(int slot)
+{
+	int		 i, n;
+
+	turn = -1;
+	for (i = 1; i <= max_children; ++i) {
+		n = (slot + i + max_children) % max_children;
+		if (kids[n].c_state != CHILD_RUNNING)
+			continue;
+		if (write(kids[n].c_turnfd, "", 1) == -1) {
+			log_warn("%s: write", __func__);
+			continue;
+		}
+		turn = n;
+		return;
+	}
+}
+
+/*
+ * A child gave back the turn, writing its slot number.  Those from
+ * children that are gone in the meantime are ignored, as it was
+ * already handed to someone else.
+ */
+static void
+turn_back(int fd, short ev, void *arg)
+{
+	unsigned char	 buf[64];
+	ssize_t		 i, n;
+
+	if ((n = read(fd, buf, sizeof(buf))) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		fatal("%s: read", __func__);
+	}
+
+	for (i = 0; i < n; ++i)
+		if (buf[i] == turn)
+			turn_next(turn);
+}
+
+static void
+respawn(int fd, short ev, void *arg)
+{
+	struct child	*c = arg;
+
+	if (!shutting_down)
+		start_child(c - kids);
+}
+
+static void
+child_exited(int slot, int status)
+{
+	struct child	*c = &kids[slot];
+	struct timeval	 tv;
+	const char	*cause;
+	int		 i;
+
+	if (WIFSIGNALED(status))
+		cause = "was terminated";
+	else if (WIFEXITED(status)) {
+		if (WEXITSTATUS(status) != 0)
+			cause = "exited abnormally";
+		else
+			cause = "exited successfully";
+	} else
+		cause = "died";
+
+	stats_release(slot);
+
+	if (shutting_down || c->c_state == CHILD_RETIRING) {
+		log_debug("child %d (pid %lld) %s", slot,
+		    (long long)c->c_pid, cause);
+		c->c_state = CHILD_FREE;
+	} else {
+		if (time(NULL) - c->c_started >= BACKOFF_RESET)
+			c->c_backoff = 0;
+		if (c->c_backoff == 0)
+			c->c_backoff = 1;
+		else if ((c->c_backoff *= 2) > MAX_BACKOFF)
+			c->c_backoff = MAX_BACKOFF;
+
+		log_warnx("child %d (pid %lld) %s, restarting it in %d"
+		    " second%s", slot, (long long)c->c_pid, cause,
+		    c->c_backoff, c->c_backoff == 1 ? "" : "s");
+
+		c->c_state = CHILD_BACKOFF;
+		timerclear(&tv);
+		tv.tv_sec = c->c_backoff;
+		evtimer_add(&c->c_respawn, &tv);
+	}
+	c->c_pid = 0;
+
+	if (turn == slot)
+		turn_next(slot);
+
+	if (shutting_down) {
+		for (i = 0; i < max_children; ++i)
+			if (kids[i].c_state != CHILD_FREE)
+				return;
+		event_loopexit(NULL);
+	}
+}
+
+static void
+spawn_reply(int fd, short ev, void *arg)
+{
+	struct spawn_msg	 msg;
+	struct child		*c;
+	int			 r;
+
+	if ((r = spawn_recv(fd, &msg)) == -1)
+		return;
+	if (r == 0)
+		fatalx("the spawner exited");
+
+	c = &kids[msg.sm_slot];
+	switch (msg.sm_type) {
+	case SPAWN_STARTED:
+		c->c_pid = msg.sm_arg;
+		log_debug("forking child %d (pid %lld)", msg.sm_slot,
+		    (long long)c->c_pid);
+		if (c->c_state != CHILD_STARTING)
+			break;
+		c->c_state = CHILD_RUNNING;
+		if (accept_serial && turn == -1)
+			turn_next(msg.sm_slot - 1);
+		break;
+	case SPAWN_EXITED:
+		child_exited(msg.sm_slot, msg.sm_arg);
+		break;
+	default:
+		fatalx("%s: unexpected message %d", __func__, msg.sm_type);
+	}
+}
+
+static void
+shutdown_children(void)
+{
+	struct child	*c;
+	int		 i, alive = 0;
+
+	shutting_down = 1;
+	for (i = 0; i < max_children; ++i) {
+		c = &kids[i];
+		if (c->c_state == CHILD_BACKOFF) {
+			evtimer_del(&c->c_respawn);
+			c->c_state = CHILD_FREE;
+		} else if (c->c_state != CHILD_FREE) {
+			spawn_send(SPAWN_KILL, i, SIGTERM);
+			alive++;
+		}
+	}
+	if (alive == 0)
+		event_loopexit(NULL);
+}
+
+static void
+parent_sig_handler(int sig, short ev, void *arg)
+{
+	switch (sig) {
+	case SIGINT:
+	case SIGTERM:
+		if (!shutting_down)
+			shutdown_children();
+		break;
+	default:
+		fatalx("unexpected signal %d", sig);
+	}
+}
+
+/*
+ * Every second, start a new child if the requests being processed are
+ * more than the running children have worker threads for, or stop one
+ * if they have been much less for a while.  The load is averaged over
+ * the last few seconds.
+ */
+static void
+scale(int fd, short ev, void *arg)
+{
+	struct event	*tick = arg;
+	struct timeval	 tv = { 1, 0 };
+	time_t		 now;
+	int64_t		 busy = 0;
+	int		 i, n = 0, cap, slot = -1;
+
+	evtimer_add(tick, &tv);
+	if (shutting_down)
+		return;
+
+	for (i = 0; i < max_children; ++i) {
+		if (kids[i].c_state == CHILD_RUNNING) {
+			busy += stats_load(i);
+			slot = i;
+		}
+		if (kids[i].c_state == CHILD_STARTING ||
+		    kids[i].c_state == CHILD_RUNNING ||
+		    kids[i].c_state == CHILD_BACKOFF)
+			n++;
+	}
+
+	load = (load + busy) / 2;
+	cap = workers > 0 ? workers : 1;
+	now = time(NULL);
+
+	if (load > n * cap && n < max_children) {
+		idle_secs = 0;
+		if (now - last_scale < SCALE_COOLDOWN)
+			return;
+		for (i = 0; i < max_children; ++i)
+			if (kids[i].c_state == CHILD_FREE)
+				break;
+		if (i == max_children)
+			return;
+		log_info("scaling up to %d children, load %.1f", n + 1,
+		    load);
+		start_child(i);
+		last_scale = now;
+		return;
+	}
+
+	if (n <= children || slot == -1 || load >= (n - 1) * cap / 2.0) {
+		idle_secs = 0;
+		return;
+	}
+
+	if (++idle_secs < SCALE_IDLE || now - last_scale < SCALE_COOLDOWN)
+		return;
+
+	log_info("scaling down to %d children, load %.1f", n - 1, load);
+	spawn_send(SPAWN_KILL, slot, SIGUSR1);
+	kids[slot].c_state = CHILD_RETIRING;
+	if (turn == slot)
+		turn_next(slot);
+	last_scale = now;
+	idle_secs = 0;
+}
+
+/*
+ * The supervisor keeps the children running and scales their number.
+ * It forks first the spawner, which keeps the privileges to start and
+ * signal them, so it can chroot and drop its own and only talk to it.
+ */
+static int
+parent_main(void)
+{
+	struct event	 sigint, sigterm, spawnev, turnev, tick;
+	struct timeval	 tv = { 1, 0 };
+	int		 i, p[2], sp[2];
+
+	if (max_children == 1)
+		accept_serial = 0;
+
+	/*
+	 * The pipes to hand the turn to the children outlive them: the
+	 * spawner passes the read ends to those it starts.
+	 */
+	for (i = 0; i < max_children; ++i) {
+		kids[i].c_turnfd = -1;
+		turn_rd[i] = -1;
+		if (!accept_serial)
+			continue;
+		if (pipe(p) == -1)
+			fatal("pipe");
+		turn_rd[i] = fd_high(p[0]);
+		kids[i].c_turnfd = fd_high(p[1]);
+		if (fcntl(turn_rd[i], F_SETFL, O_NONBLOCK) == -1)
+			fatal("fcntl");
+	}
+	if (accept_serial) {
+		if (pipe(p) == -1)
+			fatal("pipe");
+		spawn.sp_turnfd = fd_high(p[1]);
+		turn_in = fd_high(p[0]);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sp) == -1)
+		fatal("socketpair");
+	sp[0] = fd_high(sp[0]);
+	sp[1] = fd_high(sp[1]);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	switch (fork()) {
+	case -1:
+		fatal("cannot fork");
+	case 0:
+		close(sp[0]);
+		spawn_fd = sp[1];
+		for (i = 0; i < max_children; ++i)
+			if (kids[i].c_turnfd != -1)
+				close(kids[i].c_turnfd);
+		if (turn_in != -1)
+			close(turn_in);
+		spawner_main();
+	}
+
+	close(sp[1]);
+	spawn_fd = sp[0];
+	close(spawn.sp_sockfd);
+	if (spawn.sp_shfd != -1)
+		close(spawn.sp_shfd);
+	close(spawn.sp_stfd);
+	for (i = 0; i < max_children; ++i)
+		if (turn_rd[i] != -1)
+			close(turn_rd[i]);
+	if (spawn.sp_turnfd != -1)
+		close(spawn.sp_turnfd);
+
+	drop_privileges(spawn.sp_root, spawn.sp_pw);
+
+	/* the children are started and signalled by the spawner */
+	if (pledge("stdio", NULL) == -1)
+		fatal("pledge");
+
+	event_init();
+
+	signal_set(&sigint, SIGINT, parent_sig_handler, NULL);
+	signal_set(&sigterm, SIGTERM, parent_sig_handler, NULL);
+	signal_add(&sigint, NULL);
+	signal_add(&sigterm, NULL);
+
+	event_set(&spawnev, spawn_fd, EV_READ|EV_PERSIST, spawn_reply, NULL);
+	event_add(&spawnev, NULL);
+
+	for (i = 0; i < max_children; ++i)
+		evtimer_set(&kids[i].c_respawn, respawn, &kids[i]);
+
+	if (accept_serial) {
+		event_set(&turnev, turn_in, EV_READ|EV_PERSIST, turn_back,
+		    NULL);
+		event_add(&turnev, NULL);
+	}
+
+	for (i = 0; i < children; ++i)
+		start_child(i);
+
+	if (max_children > children) {
+		evtimer_set(&tick, scale, &tick);
+		evtimer_add(&tick, &tv);
+	}
+
+	event_dispatch();
+	return (0);
 }
 
 static void __dead
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-dv] [-j n] [-p path] [-s socket]"
-	    " [-t tmpldir] [-u user] [db]\n",
+	fprintf(stderr, "usage: %s [-adefvW] [-b weights] [-C kbytes] [-c n]"
+	    " [-j n[,max]] [-l msec] [-M mbytes] [-m kbytes] [-p path]"
+	    " [-Q file] [-q backlog] [-r days] [-s socket] [-t tmpldir]"
+	    " [-u user] [-w n] [db]\n",
 	    getprogname());
 	exit(1);
 }
@@ -227,9 +1058,11 @@ main(int argc, char **argv)
 	const char	*root = NULL;
 	const char	*db = MSEARCHD_DB;
 	const char	*tmpldir = MSEARCH_TMPL_DIR;
-	const char	*errstr, *cause, *argv0;
-	pid_t		 pid;
-	int		 ch, i, fd, ret, status, server = 0;
+	const char	*errstr, *argv0, *searches = NULL;
+	char		*t;
+	size_t		 shsize;
+	int		 ch, i, fd, shfd = -1, stfd, ret, server = 0;
+	int		 slot = 0;
 
 	/*
 	 * Ensure we have fds 0-2 open so that we have no issue with
@@ -250,22 +1083,93 @@ main(int argc, char **argv)
 	if ((argv0 = argv[0]) == NULL)
 		argv0 = "msearchd";
 
-	while ((ch = getopt(argc, argv, "dj:p:Ss:t:u:v")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "ab:C:c:defj:l:M:m:p:Q:q:r:S:s:t:u:vWw:")) != -1) {
 		switch (ch) {
+		case 'a':
+			accept_serial = 1;
+			break;
+		case 'b':
+			if (rank_parse_weights(optarg) == -1)
+				fatalx("invalid column weights: %s", optarg);
+			break;
+		case 'C':
+			dbcache_kb = strtonum(optarg, 0, MAX_DBCACHE, &errstr);
+			if (errstr)
+				fatalx("database cache size is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'c':
+			cache_size = strtonum(optarg, 0, MAX_CACHE, &errstr);
+			if (errstr)
+				fatalx("cache size is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			debug = 1;
 			break;
+		case 'e':
+			expose_stats = 1;
+			break;
+		case 'f':
+			prefork = 1;
+			break;
 		case 'j':
+			if ((t = strchr(optarg, ',')) != NULL)
+				*t++ = '\0';
 			children = strtonum(optarg, 1, MAX_CHILDREN, &errstr);
 			if (errstr)
 				fatalx("number of children is %s: %s",
 				    errstr, optarg);
+			max_children = children;
+			if (t == NULL)
+				break;
+			max_children = strtonum(t, children, MAX_CHILDREN,
+			    &errstr);
+			if (errstr)
+				fatalx("maximum number of children is %s: %s",
+				    errstr, t);
+			break;
+		case 'l':
+			query_timeout = strtonum(optarg, 0, MAX_TIMEOUT,
+			    &errstr);
+			if (errstr)
+				fatalx("query timeout is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'M':
+			mmap_mb = strtonum(optarg, 0, MAX_MMAP, &errstr);
+			if (errstr)
+				fatalx("mmap size is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			shcache_kb = strtonum(optarg, 0, MAX_SHCACHE, &errstr);
+			if (errstr)
+				fatalx("shared cache size is %s: %s",
+				    errstr, optarg);
 			break;
 		case 'p':
 			root = optarg;
 			break;
+		case 'Q':
+			searches = optarg;
+			break;
+		case 'q':
+			backlog = strtonum(optarg, 1, MAX_BACKLOG, &errstr);
+			if (errstr)
+				fatalx("backlog is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			rank_halflife = strtonum(optarg, 0, MAX_HALFLIFE,
+			    &errstr);
+			if (errstr)
+				fatalx("half-life is %s: %s", errstr, optarg);
+			break;
 		case 'S':
 			server = 1;
+			slot = strtonum(optarg, 0, MAX_CHILDREN - 1, &errstr);
+			if (errstr)
+				fatalx("child number is %s: %s", errstr,
+				    optarg);
 			break;
 		case 's':
 			sock = optarg;
@@ -279,6 +1183,15 @@ main(int argc, char **argv)
 		case 'v':
 			verbose++;
 			break;
+		case 'W':
+			warmup = 1;
+			break;
+		case 'w':
+			workers = strtonum(optarg, 0, MAX_WORKERS, &errstr);
+			if (errstr)
+				fatalx("number of workers is %s: %s",
+				    errstr, optarg);
+			break;
 		default:
 			usage();
 		}
@@ -305,6 +1218,8 @@ main(int argc, char **argv)
 
 	if (root == NULL)
 		root = pw->pw_dir;
+	if (max_children == 0)
+		max_children = children;
 
 	log_init(debug, LOG_DAEMON);
 
@@ -312,84 +1227,48 @@ main(int argc, char **argv)
 		fatal("daemon");
 
 	if (!server) {
-		sigset_t set;
-
-		sigemptyset(&set);
-		sigaddset(&set, SIGCHLD);
-		sigaddset(&set, SIGINT);
-		sigaddset(&set, SIGTERM);
-		sigprocmask(SIG_BLOCK, &set, NULL);
-
 		ret = snprintf(sockp, sizeof(sockp), "%s/%s", root, sock);
 		if (ret < 0 || (size_t)ret >= sizeof(sockp))
 			fatalx("socket path too long");
 		if ((fd = bind_socket(sockp, pw)) == -1)
 			fatalx("failed to open socket %s", sock);
-		for (i = 0; i < children; ++i) {
-			int d;
-
-			if ((d = dup(fd)) == -1)
-				fatalx("dup");
-			pids[i] = start_child(argv0, root, user, db, tmpldir,
-			    debug, verbose, d);
-			log_debug("forking child %d (pid %lld)", i,
-			    (long long)pids[i]);
-		}
-
-		signal(SIGINT, sighdlr);
-		signal(SIGTERM, sighdlr);
-		signal(SIGCHLD, sighdlr);
-		signal(SIGHUP, SIG_IGN);
-
-		sigprocmask(SIG_UNBLOCK, &set, NULL);
-	} else {
-		load_tmpl(&tmpl_head, tmpldir, "head.html");
-		load_tmpl(&tmpl_search, tmpldir, "search.html");
-		load_tmpl(&tmpl_search_header, tmpldir, "search-header.html");
-		load_tmpl(&tmpl_foot, tmpldir, "foot.html");
-
-		setproctitle("server");
-	}
 
-	if (chroot(root) == -1)
-		fatal("chroot %s", root);
-	if (chdir("/") == -1)
-		fatal("chdir /");
-
-	if (setgroups(1, &pw->pw_gid) == -1 ||
-	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) == -1 ||
-	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) == -1)
-		fatal("failed to drop privileges");
-
-	if (server)
-		return (server_main(db));
-
-	if (pledge("stdio proc", NULL) == -1)
-		fatal("pledge");
-
-	for (;;) {
-		do {
-			pid = waitpid(WAIT_ANY, &status, 0);
-		} while (pid != -1 || errno == EINTR);
-
-		if (pid == -1) {
-			if (errno == ECHILD)
-				break;
-			fatal("waitpid");
+		shsize = shcache_size((size_t)shcache_kb * 1024);
+		if (shsize != 0)
+			shfd = shcache_create(shsize);
+		else
+			shcache_kb = 0;
+		stfd = shm_create("stats", stats_size());
+
+		spawn.sp_argv0 = argv0;
+		if (!prefork)
+			find_self(argv0, spawn.sp_path);
+		spawn.sp_root = root;
+		spawn.sp_user = user;
+		spawn.sp_db = db;
+		spawn.sp_tmpl = tmpldir;
+		spawn.sp_searches = searches;
+		spawn.sp_pw = pw;
+		spawn.sp_sockfd = fd_high(fd);
+		spawn.sp_shfd = shfd == -1 ? -1 : fd_high(shfd);
+		spawn.sp_stfd = fd_high(stfd);
+		spawn.sp_turnfd = -1;
+
+		if (stats_attach(spawn.sp_stfd, -1) == -1)
+			fatalx("can't map the stats segment");
+
+		if (prefork) {
+			load_templates(tmpldir);
+			if (searches != NULL)
+				warmup_searches = read_file(searches);
 		}
 
-		if (WIFSIGNALED(status))
-			cause = "was terminated";
-		else if (WIFEXITED(status)) {
-			if (WEXITSTATUS(status) != 0)
-				cause = "exited abnormally";
-			else
-				cause = "exited successfully";
-		} else
-			cause = "died";
-
-		log_warnx("child process %lld %s", (long long)pid, cause);
+		return (parent_main());
 	}
 
-	return (1);
+	load_templates(tmpldir);
+	if (searches != NULL)
+		warmup_searches = read_file(searches);
+
+	return (child_main(root, pw, db, slot));
 }
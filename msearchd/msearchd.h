@@ -3,14 +3,37 @@
  */
 
 #define FD_RESERVE	5
+#define SHCACHE_FD	4
+#define STATS_FD	5
+#define ACCEPT_IN_FD	6	/* turn to accept, from the parent */
+#define ACCEPT_OUT_FD	7	/* turn to accept, back to the parent */
+#define RETIRE_TIMEOUT	30	/* seconds to finish the connections */
+#define MAX_CHILDREN	32
+#define MAX_REQUESTS	256	/* concurrent requests in a child */
 #define QUERY_MAXLEN	1025	/* including NUL */
+#define CURSOR_MAXLEN	64
+#define CACHEKEY_MAXLEN	(QUERY_MAXLEN + CURSOR_MAXLEN + 64)
+#define RESULTS_PER_PAGE 100
+#define COUNT_EXACT_MAX	1000	/* count the matches below this estimate */
+#define MAX_WORKERS	64
+#define RANK_NCOLS	3	/* from, subj and body */
+#define MATCHES_MAX	32	/* highlighted in an excerpt */
 
+struct arena_chunk;
 struct bufferevent;
+struct cache_entry;
+struct count_ent;
 struct event;
+struct evbuffer;
 struct fcgi;
+struct fts5_api;
+struct job;
+struct rank_ctx;
+struct shcache_hdr;
 struct sqlite3;
 struct sqlite3_stmt;
 struct template;
+struct vocab;
 
 enum {
 	METHOD_UNKNOWN,
@@ -18,12 +41,78 @@ enum {
 	METHOD_POST,
 };
 
+/* template variables */
+enum {
+	TV_TITLE,
+	TV_QUERY,
+	TV_DATE,
+	TV_FROM,
+	TV_MID,
+	TV_SUBJECT,
+	TV_EXCERPT,
+	TV__MAX,
+};
+
+#define TMPL_VAR(v)	(1U << (v))
+
+/* counters and histograms */
+enum {
+	ST_REQUESTS,
+	ST_ERRORS,
+	ST_ABORTS,
+	ST_TRUNCATED,
+	ST_CACHE_HITS,
+	ST_CACHE_MISSES,
+	ST__MAX,
+};
+
+enum {
+	SH_PARSE,
+	SH_QUERY,
+	SH_RENDER,
+	SH_BYTES,
+	SH__MAX,
+};
+
+enum {
+	SORT_RANK,
+	SORT_DATE,
+};
+
+enum {
+	FORMAT_HTML,
+	FORMAT_JSON,
+};
+
+enum {
+	PAGE_FIRST,
+	PAGE_AFTER,
+	PAGE_BEFORE,
+};
+
+/*
+ * The shape of a query: each has its own prepared statement, built
+ * the first time it's needed.
+ */
+#define QS_AFTER	0x01	/* page after the cursor */
+#define QS_BEFORE	0x02	/* page before the cursor */
+#define QS_DATEMIN	0x04
+#define QS_DATEMAX	0x08
+#define QS_BYDATE	0x10	/* newest first, without ranking */
+#define QS_COUNT	0x20	/* number of matches */
+#define QS__MAX		0x40
+
 #ifdef DEBUG
 #define DPRINTF		log_debug
 #else
 #define DPRINTF(...)	do {} while (0)
 #endif
 
+struct arena {
+	struct arena_chunk	*a_chunks;	/* the current one first */
+	size_t			 a_chunksz;	/* zero for the default */
+};
+
 struct client {
 	uint32_t		 clt_id;
 	int			 clt_fd;
@@ -33,18 +122,38 @@ struct client {
 	char			*clt_path_info;
 	char			*clt_query;
 	int			 clt_method;
-	char			 clt_buf[1024];
-	size_t			 clt_buflen;
+	struct evbuffer		*clt_out;
+	struct evbuffer		*clt_capture;
+	int			 clt_done;
+	int			 clt_status;
+	int			 clt_pstatus;
+	int			 clt_queued;
+	struct job		*clt_job;
+	struct job		*clt_render;	/* paused rendering */
+	int			 clt_paused;
+	int			 clt_handled;
+	uint64_t		 clt_tparse;	/* usec */
+	size_t			 clt_bytes;
+	size_t			 clt_paramlen;
+	struct arena		 clt_arena;	/* the parameters */
 
+	TAILQ_ENTRY(client)	 clt_sched;	/* and the free list */
+	TAILQ_ENTRY(client)	 clt_pause;
 	SPLAY_ENTRY(client)	 clt_nodes;
 };
+TAILQ_HEAD(client_sched, client);
 SPLAY_HEAD(client_tree, client);
 
 struct fcgi {
 	uint32_t		 fcg_id;
 	int			 fcg_s;
 	struct client_tree	 fcg_clients;
+	struct client_sched	 fcg_sched;
+	struct client_sched	 fcg_paused;
 	struct bufferevent	*fcg_bev;
+	size_t			 fcg_outlen;	/* pending in the clients */
+	int			 fcg_nhandled;	/* requests being served */
+	int			 fcg_rpaused;
 	int			 fcg_toread;
 	int			 fcg_want;
 	int			 fcg_padding;
@@ -55,34 +164,189 @@ struct fcgi {
 
 	struct env		*fcg_env;
 
+	TAILQ_ENTRY(fcgi)	 fcg_free;
 	SPLAY_ENTRY(fcgi)	 fcg_nodes;
 };
+TAILQ_HEAD(fcgi_list, fcgi);
 SPLAY_HEAD(fcgi_tree, fcgi);
 
+struct cursor {
+	double			 cur_rank;
+	int64_t			 cur_date;
+	int64_t			 cur_rowid;
+};
+
+struct query {
+	char			*q_text;
+	int			 q_page;
+	int			 q_sort;
+	int			 q_dir;
+	int			 q_format;
+	struct cursor		 q_cursor;
+	int			 q_hasmin;
+	int			 q_hasmax;
+	int64_t			 q_datemin;	/* if q_hasmin */
+	int64_t			 q_datemax;	/* if q_hasmax */
+	struct timespec		 q_deadline;	/* zero if none */
+};
+
+struct row {
+	struct cursor		 r_cursor;
+	char			*r_mid;
+	char			*r_from;
+	char			*r_subj;
+	char			*r_snip;
+};
+
+/* a part of a string, in bytes */
+struct span {
+	size_t			 sp_off;
+	size_t			 sp_len;
+};
+
+struct result {
+	struct row		 res_rows[RESULTS_PER_PAGE];
+	size_t			 res_nrows;
+	int			 res_prev;
+	int			 res_next;
+	int			 res_complete;
+	int			 res_truncated;
+	int64_t			 res_count;	/* -1 if unknown */
+	int			 res_exact;
+	uint64_t		 res_usec;
+};
+
+struct dbwatch {
+	struct sqlite3		*dw_db;
+	struct sqlite3_stmt	*dw_version;
+	int64_t			 dw_gen;	/* data_version */
+	dev_t			 dw_dev;
+	ino_t			 dw_ino;
+	struct event		 dw_ev;
+};
+
+struct dbconn {
+	struct sqlite3		*dbc_db;
+	struct sqlite3_stmt	*dbc_stmts[QS__MAX];
+	struct sqlite3_stmt	*dbc_row;
+	struct sqlite3_stmt	*dbc_range;
+	struct vocab		*dbc_vocab;
+	struct rank_ctx		*dbc_rank;
+	struct count_ent	*dbc_counts;
+	struct timespec		 dbc_deadline;
+	int			 dbc_stale;	/* mails were added */
+};
+
+enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+/*
+ * A query run by the worker threads.  j_clt is only used by the main
+ * thread and is NULL if the client went away in the meantime.
+ */
+struct job {
+	struct client		*j_clt;
+	int			 j_state;
+	int			 j_err;
+	struct query		 j_query;
+	char			 j_esc[QUERY_MAXLEN];
+	char			 j_key[CACHEKEY_MAXLEN];
+	struct result		 j_res;
+	struct arena		 j_arena;	/* the strings of j_res */
+	size_t			 j_row;		/* next one to render */
+	uint64_t		 j_gen;		/* of the caches at submit */
+	uint64_t		 j_shgen;
+	uint64_t		 j_trender;	/* usec */
+
+	TAILQ_ENTRY(job)	 j_entry;
+};
+TAILQ_HEAD(jobs, job);
+
+struct cache {
+	RB_HEAD(cache_tree, cache_entry)	 c_entries;
+	TAILQ_HEAD(cache_lru, cache_entry)	 c_lru;
+	size_t					 c_count;
+	size_t					 c_max;
+	uint64_t				 c_gen;
+	uint64_t				 c_hits;
+	uint64_t				 c_misses;
+};
+
+struct shcache {
+	struct shcache_hdr	*sc_hdr;
+	char			*sc_slots;
+	size_t			 sc_nslots;
+	uint64_t		 sc_gen;
+	uint64_t		 sc_hits;
+	uint64_t		 sc_misses;
+};
+
 struct env {
+	int			 env_slot;
 	int			 env_sockfd;
 	struct event		 env_sockev;
 	struct event		 env_pausev;
+	struct event		 env_turnev;
+	int			 env_turn;	/* our turn to accept */
 	struct fcgi_tree	 env_fcgi_socks;
 
-	struct sqlite3		*env_db;
-	struct sqlite3_stmt	*env_query;
+	struct dbconn		 env_dbc;
+	struct dbwatch		 env_watch;
+
+	struct cache		 env_cache;
+	struct evbuffer		*env_hit;	/* cached reply */
+	struct shcache		 env_shcache;
+	uint64_t		 env_truncated;
 };
 
+/* arena.c */
+void	 arena_init(struct arena *, size_t);
+void	*arena_alloc(struct arena *, size_t);
+char	*arena_strdup(struct arena *, const char *);
+void	 arena_reset(struct arena *);
+void	 arena_free(struct arena *);
+
+/* cache.c */
+void	cache_init(struct cache *, size_t);
+int	cache_key(const char *, char *, size_t);
+int	cache_get(struct cache *, const char *, const char **, size_t *);
+void	cache_put(struct cache *, const char *, const void *, size_t);
+void	cache_flush(struct cache *);
+void	cache_expire(struct cache *);
+size_t	shcache_size(size_t);
+void	shcache_format(void *, size_t);
+int	shcache_attach(struct shcache *, int);
+void	shcache_reload(struct shcache *);
+int	shcache_get(struct shcache *, const char *, struct evbuffer *,
+	    uint64_t *);
+void	shcache_put(struct shcache *, const char *, const void *, size_t);
+
 /* fcgi.c */
 int	fcgi_end_request(struct client *, int);
 int	fcgi_abort_request(struct client *);
 void	fcgi_accept(int, short, void *);
+void	fcgi_take_turn(int, short, void *);
+void	fcgi_retire(struct env *);
 void	fcgi_read(struct bufferevent *, void *);
 void	fcgi_write(struct bufferevent *, void *);
 void	fcgi_error(struct bufferevent *, short, void *);
 void	fcgi_free(struct fcgi *);
+void	clt_free(struct client *);
+int	clt_putref(struct client *, const void *, size_t);
 int	clt_putc(struct client *, char);
 int	clt_puts(struct client *, const char *);
 int	clt_putsan(struct client *, const char *);
 int	clt_putmatch(struct client *, const char *);
+int	clt_putjson(struct client *, const char *);
+int	clt_putjsonmatch(struct client *, const char *, struct span *,
+	    size_t *);
 int	clt_write_bufferevent(struct client *, struct bufferevent *);
 int	clt_flush(struct client *);
+int	clt_congested(struct client *);
+int	clt_pause(struct client *);
 int	clt_write(struct client *, const uint8_t *, size_t);
 int	clt_printf(struct client *, const char *, ...)
 	    __attribute__((__format__(printf, 2, 3)))
@@ -91,14 +355,71 @@ int	fcgi_cmp(struct fcgi *, struct fcgi *);
 int	fcgi_client_cmp(struct client *, struct client *);
 
 /* msearchd.c */
-extern const char	*tmpl_head;
-extern const char	*tmpl_search;
-extern const char	*tmpl_search_header;
-extern const char	*tmpl_foot;
+extern int		 accept_serial;
+extern int		 expose_stats;
+extern int		 cache_size;
+extern int		 shcache_kb;
+extern int		 dbcache_kb;
+extern int		 mmap_mb;
+extern int		 warmup;
+extern char		*warmup_searches;
+extern int		 workers;
+extern int		 query_timeout;
+extern double		 rank_weights[RANK_NCOLS];
+extern int		 rank_halflife;
+extern struct template	*tmpl_head;
+extern struct template	*tmpl_search;
+extern struct template	*tmpl_search_header;
+extern struct template	*tmpl_search_result;
+extern struct template	*tmpl_foot;
+
+/* pool.c */
+int	pool_init(struct env *, int);
+int	pool_submit(struct job *);
+void	pool_cancel(struct job *);
+void	pool_reload(int);
+
+/* rank.c */
+int	rank_parse_weights(const char *);
+struct rank_ctx	*rank_register(struct sqlite3 *);
+void	rank_refresh(struct rank_ctx *, struct sqlite3 *);
+struct fts5_api	*rank_fts5_api(struct sqlite3 *);
+
+/* stats.c */
+size_t	 stats_size(void);
+int	 stats_attach(int, int);
+int64_t	 stats_load(int);
+void	 stats_release(int);
+uint64_t stats_now(void);
+void	 stats_count(int);
+void	 stats_inflight(int);
+void	 stats_busy(int);
+void	 stats_observe(int, uint64_t);
+int	 stats_render(struct client *);
+
+/* vocab.c */
+struct vocab	*vocab_open(struct sqlite3 *);
+void		 vocab_close(struct vocab *);
+int		 vocab_refresh(struct vocab *);
+int64_t		 vocab_estimate(struct vocab *, const char *, int64_t, int64_t);
+
+/* tmpl.c */
+struct template	*tmpl_compile(char *, unsigned int);
+int	tmpl_render(struct client *, const struct template *, const char **);
 
 /* server.c */
-int	server_main(const char *);
+extern char	dbpath[];
+int	server_open_db(struct dbconn *, int);
+int	server_reopen_db(struct dbconn *, int);
+void	server_close_db(struct dbconn *);
+int	server_fetch(struct dbconn *, struct query *, const char *,
+	    struct result *, struct arena *);
+int	server_job_done(struct env *, struct job *);
+void	server_job_free(struct job *);
+int	server_main(const char *, int);
+void	server_warmup(void);
 int	server_handle(struct env *, struct client *);
+int	server_resume(struct client *);
 void	server_client_free(struct client *);
 
 SPLAY_PROTOTYPE(client_tree, client, clt_nodes, fcgi_client_cmp);
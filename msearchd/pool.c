@@ -0,0 +1,206 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+/*
+ * A small pool of threads, each with its own read-only connection to
+ * the database, runs the queries so that a slow one doesn't stall the
+ * event loop.  Finished jobs are handed back to the main thread
+ * through a pipe.
+ */
+
+static pthread_mutex_t	 pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 pool_cond = PTHREAD_COND_INITIALIZER;
+static struct jobs	 pool_queued = TAILQ_HEAD_INITIALIZER(pool_queued);
+static struct jobs	 pool_done = TAILQ_HEAD_INITIALIZER(pool_done);
+static unsigned int	 pool_gen;
+static unsigned int	 pool_reopen_gen;
+static int		 pool_pipe[2] = { -1, -1 };
+static struct event	 pool_ev;
+
+static void *
+pool_worker(void *arg)
+{
+	struct dbconn	 dbc;
+	struct job	*job;
+	unsigned int	 gen, rgen;
+	int		 reopen;
+	char		 c = 0;
+
+	pthread_mutex_lock(&pool_mtx);
+	gen = pool_gen;
+	rgen = pool_reopen_gen;
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (server_open_db(&dbc, SQLITE_OPEN_NOMUTEX) == -1)
+		fatalx("can't open the database");
+
+	for (;;) {
+		pthread_mutex_lock(&pool_mtx);
+		while ((job = TAILQ_FIRST(&pool_queued)) == NULL)
+			pthread_cond_wait(&pool_cond, &pool_mtx);
+		TAILQ_REMOVE(&pool_queued, job, j_entry);
+		job->j_state = JOB_RUNNING;
+		if (gen != pool_gen) {
+			gen = pool_gen;
+			reopen = rgen != pool_reopen_gen;
+			rgen = pool_reopen_gen;
+			pthread_mutex_unlock(&pool_mtx);
+			if (!reopen)
+				dbc.dbc_stale = 1;
+			else if (server_reopen_db(&dbc,
+			    SQLITE_OPEN_NOMUTEX) == -1)
+				log_warnx("keeping the old database");
+		} else
+			pthread_mutex_unlock(&pool_mtx);
+
+		job->j_err = server_fetch(&dbc, &job->j_query, job->j_esc,
+		    &job->j_res, &job->j_arena);
+
+		pthread_mutex_lock(&pool_mtx);
+		job->j_state = JOB_DONE;
+		TAILQ_INSERT_TAIL(&pool_done, job, j_entry);
+		pthread_mutex_unlock(&pool_mtx);
+
+		/* a full pipe already has a wakeup pending */
+		if (write(pool_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+			fatal("%s: write", __func__);
+	}
+
+	return (NULL);
+}
+
+static void
+pool_dispatch(int fd, short ev, void *arg)
+{
+	struct env	*env = arg;
+	struct jobs	 done;
+	struct job	*job;
+	struct client	*clt;
+	char		 buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		/* nop */ ;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&pool_mtx);
+	TAILQ_CONCAT(&done, &pool_done, j_entry);
+	pthread_mutex_unlock(&pool_mtx);
+
+	while ((job = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, job, j_entry);
+		if ((clt = job->j_clt) != NULL)
+			clt->clt_job = NULL;
+
+		/* the client is gone or the request was aborted */
+		if (clt == NULL || clt->clt_done) {
+			server_job_free(job);
+			continue;
+		}
+		server_job_done(env, job);
+	}
+}
+
+int
+pool_init(struct env *env, int n)
+{
+	pthread_t	 th;
+	sigset_t	 set, oset;
+	int		 i, err, flags;
+
+	if (pipe(pool_pipe) == -1) {
+		log_warn("%s: pipe", __func__);
+		return (-1);
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if ((flags = fcntl(pool_pipe[i], F_GETFL)) == -1 ||
+		    fcntl(pool_pipe[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+		    fcntl(pool_pipe[i], F_SETFD, FD_CLOEXEC) == -1) {
+			log_warn("%s: fcntl", __func__);
+			return (-1);
+		}
+	}
+
+	/* leave the signals to the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for (i = 0; i < n; ++i) {
+		if ((err = pthread_create(&th, NULL, pool_worker, NULL)) != 0) {
+			log_warnx("%s: pthread_create: %s", __func__,
+			    strerror(err));
+			return (-1);
+		}
+		pthread_detach(th);
+	}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	event_set(&pool_ev, pool_pipe[0], EV_READ|EV_PERSIST, pool_dispatch,
+	    env);
+	event_add(&pool_ev, NULL);
+	return (0);
+}
+
+int
+pool_submit(struct job *job)
+{
+	pthread_mutex_lock(&pool_mtx);
+	job->j_state = JOB_QUEUED;
+	TAILQ_INSERT_TAIL(&pool_queued, job, j_entry);
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_mtx);
+	return (0);
+}
+
+/*
+ * Called when the client goes away: a job that no worker picked up
+ * yet is freed, otherwise it's discarded once finished.
+ */
+void
+pool_cancel(struct job *job)
+{
+	int		 queued;
+
+	pthread_mutex_lock(&pool_mtx);
+	if ((queued = job->j_state == JOB_QUEUED))
+		TAILQ_REMOVE(&pool_queued, job, j_entry);
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (queued)
+		server_job_free(job);
+	else
+		job->j_clt = NULL;
+}
+
+/*
+ * Have the workers refresh their connection, or with reopen open the
+ * database again, before their next query.  Until then they keep
+ * using the old connection.
+ */
+void
+pool_reload(int reopen)
+{
+	pthread_mutex_lock(&pool_mtx);
+	pool_gen++;
+	if (reopen)
+		pool_reopen_gen++;
+	pthread_mutex_unlock(&pool_mtx);
+}
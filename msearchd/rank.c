@@ -0,0 +1,259 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+/*
+ * msrank(email, date) is an fts5 auxiliary function that scores a
+ * match like the builtin bm25(), with the column weights given by -b,
+ * then scales it down the older the mail is compared to the newest
+ * one in the database: a mail -r days older than it gets half the
+ * score.  Lower is better, as for bm25().
+ */
+
+#define BM25_K1		1.2
+#define BM25_B		0.75
+
+struct rank_ctx {
+	double		 rc_weights[RANK_NCOLS];
+	double		 rc_halflife;		/* seconds, zero if none */
+	int64_t		 rc_newest;
+};
+
+/* per-query data, computed on the first row */
+struct rank_query {
+	int		 rq_nphrase;
+	double		 rq_avgdl;
+	double		*rq_idf;
+	double		*rq_freq;
+};
+
+/*
+ * Parse the -b argument: a comma-separated list of weights for the
+ * from, subject and body columns.
+ */
+int
+rank_parse_weights(const char *s)
+{
+	double		 w[RANK_NCOLS];
+	char		*ep;
+	int		 i;
+
+	for (i = 0; i < RANK_NCOLS; ++i) {
+		w[i] = strtod(s, &ep);
+		if (ep == s || w[i] < 0 || w[i] > 1000)
+			return (-1);
+		if (i < RANK_NCOLS - 1 && *ep != ',')
+			return (-1);
+		s = ep + 1;
+	}
+	if (*ep != '\0')
+		return (-1);
+
+	memcpy(rank_weights, w, sizeof(rank_weights));
+	return (0);
+}
+
+static int
+rank_count(const Fts5ExtensionApi *api, Fts5Context *fts, void *arg)
+{
+	sqlite3_int64	*n = arg;
+
+	(*n)++;
+	return (SQLITE_OK);
+}
+
+static void
+rank_query_free(void *arg)
+{
+	struct rank_query	*rq = arg;
+
+	free(rq->rq_idf);
+	free(rq);
+}
+
+static struct rank_query *
+rank_query_new(const Fts5ExtensionApi *api, Fts5Context *fts, int *err)
+{
+	struct rank_query	*rq;
+	sqlite3_int64		 nrow = 0, ntok = 0, nhit;
+	int			 i;
+
+	if ((rq = calloc(1, sizeof(*rq))) == NULL) {
+		*err = SQLITE_NOMEM;
+		return (NULL);
+	}
+
+	rq->rq_nphrase = api->xPhraseCount(fts);
+	if ((rq->rq_idf = calloc(rq->rq_nphrase * 2,
+	    sizeof(*rq->rq_idf))) == NULL) {
+		free(rq);
+		*err = SQLITE_NOMEM;
+		return (NULL);
+	}
+	rq->rq_freq = rq->rq_idf + rq->rq_nphrase;
+
+	if ((*err = api->xRowCount(fts, &nrow)) != SQLITE_OK ||
+	    (*err = api->xColumnTotalSize(fts, -1, &ntok)) != SQLITE_OK)
+		goto err;
+	rq->rq_avgdl = nrow > 0 ? (double)ntok / nrow : 1.0;
+
+	for (i = 0; i < rq->rq_nphrase; ++i) {
+		nhit = 0;
+		if ((*err = api->xQueryPhrase(fts, i, &nhit, rank_count))
+		    != SQLITE_OK)
+			goto err;
+		rq->rq_idf[i] = log((nrow - nhit + 0.5) / (nhit + 0.5));
+		if (rq->rq_idf[i] <= 0.0)
+			rq->rq_idf[i] = 1e-6;
+	}
+
+	if ((*err = api->xSetAuxdata(fts, rq, rank_query_free)) != SQLITE_OK)
+		return (NULL);	/* already freed */
+	return (rq);
+
+err:
+	rank_query_free(rq);
+	return (NULL);
+}
+
+static void
+rank_func(const Fts5ExtensionApi *api, Fts5Context *fts,
+    sqlite3_context *ctx, int nval, sqlite3_value **vals)
+{
+	struct rank_ctx		*rc;
+	struct rank_query	*rq;
+	double			 score = 0.0, dl, age, w, norm;
+	int			 i, n, phrase, col, off, ntok, err = SQLITE_OK;
+
+	rc = api->xUserData(fts);
+
+	if ((rq = api->xGetAuxdata(fts, 0)) == NULL &&
+	    (rq = rank_query_new(api, fts, &err)) == NULL) {
+		sqlite3_result_error_code(ctx, err);
+		return;
+	}
+
+	memset(rq->rq_freq, 0, rq->rq_nphrase * sizeof(*rq->rq_freq));
+	if ((err = api->xInstCount(fts, &n)) != SQLITE_OK)
+		goto err;
+	for (i = 0; i < n; ++i) {
+		if ((err = api->xInst(fts, i, &phrase, &col, &off))
+		    != SQLITE_OK)
+			goto err;
+		if (col >= 0 && col < RANK_NCOLS)
+			rq->rq_freq[phrase] += rc->rc_weights[col];
+	}
+
+	if ((err = api->xColumnSize(fts, -1, &ntok)) != SQLITE_OK)
+		goto err;
+	dl = ntok;
+	norm = BM25_K1 * (1.0 - BM25_B + BM25_B * dl / rq->rq_avgdl);
+
+	for (i = 0; i < rq->rq_nphrase; ++i) {
+		w = rq->rq_freq[i];
+		score += rq->rq_idf[i] * (w * (BM25_K1 + 1.0)) / (w + norm);
+	}
+
+	if (rc->rc_halflife > 0 && nval > 0) {
+		age = rc->rc_newest - sqlite3_value_int64(vals[0]);
+		if (age > 0)
+			score *= rc->rc_halflife / (rc->rc_halflife + age);
+	}
+
+	sqlite3_result_double(ctx, -score);
+	return;
+
+err:
+	sqlite3_result_error_code(ctx, err);
+}
+
+fts5_api *
+rank_fts5_api(sqlite3 *db)
+{
+	sqlite3_stmt	*stmt;
+	fts5_api	*api = NULL;
+
+	if (sqlite3_prepare_v2(db, "select fts5(?1)", -1, &stmt, NULL)
+	    != SQLITE_OK)
+		return (NULL);
+	sqlite3_bind_pointer(stmt, 1, &api, "fts5_api_ptr", NULL);
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	return (api);
+}
+
+static int64_t
+rank_newest(sqlite3 *db)
+{
+	sqlite3_stmt	*stmt;
+	int64_t		 newest = 0;
+
+	if (sqlite3_prepare_v2(db, "select max(date) from mail", -1, &stmt,
+	    NULL) != SQLITE_OK)
+		return (0);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		newest = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return (newest);
+}
+
+/*
+ * Register msrank() on the given connection.  The age of the mails is
+ * measured from the newest one at the time the database is opened or
+ * refreshed, so that the scores, and thus the page cursors, don't
+ * change as time goes by.  The context is owned by the connection.
+ */
+struct rank_ctx *
+rank_register(struct sqlite3 *db)
+{
+	struct rank_ctx	*rc;
+	fts5_api	*api;
+	int		 err;
+
+	if ((api = rank_fts5_api(db)) == NULL) {
+		log_warnx("%s: fts5 is not available", __func__);
+		return (NULL);
+	}
+
+	if ((rc = calloc(1, sizeof(*rc))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	memcpy(rc->rc_weights, rank_weights, sizeof(rc->rc_weights));
+	rc->rc_halflife = (double)rank_halflife * 24 * 60 * 60;
+	rank_refresh(rc, db);
+
+	err = api->xCreateFunction(api, "msrank", rc, rank_func, free);
+	if (err != SQLITE_OK) {
+		log_warnx("%s: xCreateFunction: %s", __func__,
+		    sqlite3_errstr(err));
+		free(rc);
+		return (NULL);
+	}
+	return (rc);
+}
+
+/*
+ * Measure the age of the mails from the newest one in the database
+ * now, after mails were added.
+ */
+void
+rank_refresh(struct rank_ctx *rc, struct sqlite3 *db)
+{
+	if (rank_halflife != 0)
+		rc->rc_newest = rank_newest(db);
+}
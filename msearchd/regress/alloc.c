@@ -0,0 +1,302 @@
+/*
+ * This file is in the public domain.
+ */
+
+/*
+ * Count what fcgi.c and arena.c allocate for the requests on new and
+ * kept-alive connections once the free lists are warm: the fcgi and
+ * client objects, with their output buffer, and the parameters in the
+ * first chunk of the arena must all be recycled.  server_handle is a
+ * stub, so the searches, their jobs and results aren't covered, nor is
+ * what libevent allocates for the contents of its buffers.  arena.c
+ * is built for this test with its malloc calls renamed to
+ * count_malloc.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int	nallocs;
+
+void	*count_malloc(size_t);
+
+void *
+count_malloc(size_t size)
+{
+	nallocs++;
+	return (malloc(size));
+}
+
+static void *
+count_calloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return (calloc(nmemb, size));
+}
+
+static int
+count_vasprintf(char **ret, const char *fmt, va_list ap)
+{
+	nallocs++;
+	return (vasprintf(ret, fmt, ap));
+}
+
+static struct evbuffer *
+count_evbuffer_new(void)
+{
+	nallocs++;
+	return (evbuffer_new());
+}
+
+static struct bufferevent *
+count_bufferevent_new(int fd, evbuffercb readcb, evbuffercb writecb,
+    everrorcb errorcb, void *arg)
+{
+	nallocs++;
+	return (bufferevent_new(fd, readcb, writecb, errorcb, arg));
+}
+
+#define malloc(size)		count_malloc(size)
+#define calloc(nmemb, size)	count_calloc(nmemb, size)
+#define vasprintf(r, f, ap)	count_vasprintf(r, f, ap)
+#define evbuffer_new()		count_evbuffer_new()
+#define bufferevent_new(fd, r, w, e, arg) \
+	count_bufferevent_new(fd, r, w, e, arg)
+
+#include "../fcgi.c"
+
+#define WARMUP	16
+#define NRUNS	1000
+#define MAXLOOP	10000	/* event loop runs before giving up */
+
+static const char *params[][2] = {
+	{ "GATEWAY_INTERFACE",	"CGI/1.1" },
+	{ "QUERY_STRING",	"q=kernel+panic&sort=date" },
+	{ "REQUEST_METHOD",	"GET" },
+	{ "SCRIPT_NAME",	"/search" },
+	{ "PATH_INFO",		"" },
+	{ "SERVER_NAME",	"marc.example.org" },
+	{ "HTTP_USER_AGENT",	"Mozilla/5.0 (X11; Linux x86_64)" },
+};
+#define NPARAMS	(sizeof(params) / sizeof(params[0]))
+
+static void	 quiet(const char *, ...);
+
+/* the connections are logged at every turn */
+static const struct logger testlogger = {
+	.fatal =	&err,
+	.fatalx =	&errx,
+	.warn =		&warn,
+	.warnx =	&warnx,
+	.info =		&quiet,
+	.debug =	&quiet,
+};
+
+static struct env	 env;
+static unsigned char	 reply[65536];
+static size_t		 replylen;
+
+static void
+quiet(const char *fmt, ...)
+{
+}
+
+static size_t
+record(unsigned char *p, int type, int id, const void *data, size_t len)
+{
+	struct fcgi_header	*h = (struct fcgi_header *)p;
+
+	memset(h, 0, sizeof(*h));
+	h->version = 1;
+	h->type = type;
+	h->req_id1 = id >> 8;
+	h->req_id0 = id & 0xff;
+	h->content_len1 = len >> 8;
+	h->content_len0 = len & 0xff;
+	memcpy(p + sizeof(*h), data, len);
+	return (sizeof(*h) + len);
+}
+
+static void
+request(int s, int id, int keep)
+{
+	struct fcgi_begin_req	 breq;
+	unsigned char		 buf[2048], body[1024];
+	size_t			 i, len = 0, blen = 0, nl, vl;
+
+	memset(&breq, 0, sizeof(breq));
+	breq.role0 = FCGI_RESPONDER;
+	breq.flags = keep ? FCGI_KEEP_CONN : 0;
+	len += record(buf, FCGI_BEGIN_REQUEST, id, &breq, sizeof(breq));
+
+	for (i = 0; i < NPARAMS; ++i) {
+		nl = strlen(params[i][0]);
+		vl = strlen(params[i][1]);
+		body[blen++] = nl;
+		body[blen++] = vl;
+		memcpy(body + blen, params[i][0], nl);
+		blen += nl;
+		memcpy(body + blen, params[i][1], vl);
+		blen += vl;
+	}
+	len += record(buf + len, FCGI_PARAMS, id, body, blen);
+	len += record(buf + len, FCGI_PARAMS, id, NULL, 0);
+
+	if (write(s, buf, len) != (ssize_t)len)
+		fatal("write");
+}
+
+/*
+ * Run the event loop until the reply to the request id is read, and
+ * the connection is closed too unless keep.
+ */
+static void
+pump(int s, int id, int keep)
+{
+	struct fcgi_header	*h;
+	size_t			 off, len;
+	ssize_t			 n;
+	int			 i, ended = 0;
+
+	for (i = 0; i < MAXLOOP; ++i) {
+		event_loop(EVLOOP_NONBLOCK);
+
+		n = recv(s, reply + replylen, sizeof(reply) - replylen,
+		    MSG_DONTWAIT);
+		if (n == -1 && errno != EAGAIN)
+			fatal("recv");
+		if (n == 0) {
+			if (keep || !ended)
+				fatalx("connection closed early");
+			return;
+		}
+		if (n > 0)
+			replylen += n;
+
+		for (off = 0; replylen - off >= sizeof(*h); off += len) {
+			h = (struct fcgi_header *)(reply + off);
+			len = sizeof(*h) + (h->content_len1 << 8 |
+			    h->content_len0) + h->padding;
+			if (replylen - off < len)
+				break;
+			if (h->type == FCGI_END_REQUEST &&
+			    (h->req_id1 << 8 | h->req_id0) == id)
+				ended = 1;
+		}
+		memmove(reply, reply + off, replylen - off);
+		replylen -= off;
+
+		if (ended && keep)
+			return;
+	}
+	fatalx("no reply to request %d", id);
+}
+
+static int
+connect_to(const char *path)
+{
+	struct sockaddr_un	 sun;
+	int			 s;
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("connect %s", path);
+
+	fcgi_accept(env.env_sockfd, EV_READ, &env);
+	return (s);
+}
+
+/* a connection for a single request */
+static void
+new_conn(const char *path)
+{
+	int	 s;
+
+	s = connect_to(path);
+	request(s, 1, 0);
+	pump(s, 1, 0);
+	close(s);
+}
+
+/* n requests on the same connection */
+static void
+kept_conn(const char *path, int n)
+{
+	int	 i, s;
+
+	s = connect_to(path);
+	for (i = 0; i < n; ++i) {
+		request(s, i % 2 + 1, 1);
+		pump(s, i % 2 + 1, 1);
+	}
+	close(s);
+
+	for (i = 0; i < MAXLOOP && fcgi_inflight != 0; ++i)
+		event_loop(EVLOOP_NONBLOCK);
+	if (fcgi_inflight != 0)
+		fatalx("connection not closed");
+}
+
+int
+main(void)
+{
+	struct sockaddr_un	 sun;
+	char			 dir[] = "/tmp/alloc.XXXXXXXXXX";
+	char			 path[PATH_MAX];
+	int			 i, s;
+
+	log_init(1, 0);
+	logger = &testlogger;
+	event_init();
+
+	if (mkdtemp(dir) == NULL)
+		fatal("mkdtemp");
+	(void)snprintf(path, sizeof(path), "%s/sock", dir);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("bind %s", path);
+	if (listen(s, 8) == -1)
+		fatal("listen");
+
+	env.env_sockfd = s;
+	SPLAY_INIT(&env.env_fcgi_socks);
+
+	for (i = 0; i < WARMUP; ++i)
+		new_conn(path);
+	kept_conn(path, WARMUP);
+
+	nallocs = 0;
+	for (i = 0; i < NRUNS; ++i)
+		new_conn(path);
+	if (nallocs != 0)
+		fatalx("%d allocations for %d new connections", nallocs,
+		    NRUNS);
+
+	kept_conn(path, NRUNS);
+	if (nallocs != 0)
+		fatalx("%d allocations for %d kept-alive requests", nallocs,
+		    NRUNS);
+
+	close(s);
+	unlink(path);
+	rmdir(dir);
+
+	printf("alloc: %d requests, no allocations in fcgi.c\n", 2 * NRUNS);
+	return (0);
+}
@@ -0,0 +1,250 @@
+/*
+ * This file is in the public domain.
+ */
+
+/*
+ * Send requests without a query through fcgi.c to server_handle and
+ * check the content type of the replies: JSON for a script name or
+ * path info ending in .json, as they come from the web server, or for
+ * format=json, HTML otherwise.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>
+
+#include "../fcgi.c"
+
+#define MAXLOOP	10000	/* event loop runs before giving up */
+
+int		 accept_serial;
+int		 expose_stats;
+int		 cache_size;
+int		 shcache_kb;
+int		 dbcache_kb;
+int		 mmap_mb;
+int		 warmup;
+char		*warmup_searches;
+int		 workers;
+int		 query_timeout;
+double		 rank_weights[RANK_NCOLS];
+int		 rank_halflife;
+struct template	*tmpl_head;
+struct template	*tmpl_search;
+struct template	*tmpl_search_header;
+struct template	*tmpl_search_result;
+struct template	*tmpl_foot;
+
+static const struct {
+	const char	*script;
+	const char	*path;
+	const char	*query;
+	const char	*type;
+} tests[] = {
+	{ "/search",		"",		"",
+	    "text/html" },
+	{ "/search",		"",		"format=json",
+	    "application/json" },
+	{ "/search.json",	"",		"",
+	    "application/json" },
+	{ "/search.json/",	"",		"",
+	    "application/json" },
+	{ "/search.json",	"",		"format=html",
+	    "text/html" },
+	{ "/search",		"/x.json",	"",
+	    "application/json" },
+	{ "/json",		"",		"",
+	    "text/html" },
+};
+#define NTESTS	(sizeof(tests) / sizeof(tests[0]))
+
+static void	 quiet(const char *, ...);
+
+static const struct logger testlogger = {
+	.fatal =	&err,
+	.fatalx =	&errx,
+	.warn =		&warn,
+	.warnx =	&warnx,
+	.info =		&quiet,
+	.debug =	&quiet,
+};
+
+static struct env	 env;
+
+static void
+quiet(const char *fmt, ...)
+{
+}
+
+static struct template *
+compile(const char *str)
+{
+	struct template	*tp;
+	char		*buf;
+
+	if ((buf = strdup(str)) == NULL)
+		fatal("strdup");
+	if ((tp = tmpl_compile(buf, 0)) == NULL)
+		fatalx("tmpl_compile");
+	return (tp);
+}
+
+static size_t
+record(unsigned char *p, int type, const void *data, size_t len)
+{
+	struct fcgi_header	*h = (struct fcgi_header *)p;
+
+	memset(h, 0, sizeof(*h));
+	h->version = 1;
+	h->type = type;
+	h->req_id0 = 1;
+	h->content_len1 = len >> 8;
+	h->content_len0 = len & 0xff;
+	memcpy(p + sizeof(*h), data, len);
+	return (sizeof(*h) + len);
+}
+
+static size_t
+param(unsigned char *p, const char *name, const char *val)
+{
+	size_t		 nl = strlen(name), vl = strlen(val);
+
+	p[0] = nl;
+	p[1] = vl;
+	memcpy(p + 2, name, nl);
+	memcpy(p + 2 + nl, val, vl);
+	return (2 + nl + vl);
+}
+
+static void
+request(int s, const char *script, const char *path, const char *query)
+{
+	struct fcgi_begin_req	 breq;
+	unsigned char		 buf[2048], body[1024];
+	size_t			 len = 0, blen = 0;
+
+	memset(&breq, 0, sizeof(breq));
+	breq.role0 = FCGI_RESPONDER;
+	len += record(buf, FCGI_BEGIN_REQUEST, &breq, sizeof(breq));
+
+	blen += param(body + blen, "REQUEST_METHOD", "GET");
+	blen += param(body + blen, "SCRIPT_NAME", script);
+	blen += param(body + blen, "PATH_INFO", path);
+	blen += param(body + blen, "QUERY_STRING", query);
+	len += record(buf + len, FCGI_PARAMS, body, blen);
+	len += record(buf + len, FCGI_PARAMS, NULL, 0);
+
+	if (write(s, buf, len) != (ssize_t)len)
+		fatal("write");
+}
+
+/*
+ * Run the event loop until the connection is closed, and return the
+ * content of the FCGI_STDOUT records.
+ */
+static char *
+reply(int s, char *out, size_t outsize)
+{
+	static unsigned char	 buf[65536];
+	struct fcgi_header	*h;
+	size_t			 off, len, clen, buflen = 0, outlen = 0;
+	ssize_t			 n;
+	int			 i;
+
+	for (i = 0; i < MAXLOOP; ++i) {
+		event_loop(EVLOOP_NONBLOCK);
+
+		n = recv(s, buf + buflen, sizeof(buf) - buflen, MSG_DONTWAIT);
+		if (n == -1 && errno != EAGAIN)
+			fatal("recv");
+		if (n > 0)
+			buflen += n;
+
+		for (off = 0; buflen - off >= sizeof(*h); off += len) {
+			h = (struct fcgi_header *)(buf + off);
+			clen = h->content_len1 << 8 | h->content_len0;
+			len = sizeof(*h) + clen + h->padding;
+			if (buflen - off < len)
+				break;
+			if (h->type != FCGI_STDOUT)
+				continue;
+			if (outlen + clen >= outsize)
+				fatalx("reply too long");
+			memcpy(out + outlen, buf + off + sizeof(*h), clen);
+			outlen += clen;
+		}
+		memmove(buf, buf + off, buflen - off);
+		buflen -= off;
+
+		if (n == 0) {
+			out[outlen] = '\0';
+			return (out);
+		}
+	}
+	fatalx("no reply");
+}
+
+int
+main(void)
+{
+	struct sockaddr_un	 sun;
+	char			 dir[] = "/tmp/format.XXXXXXXXXX";
+	char			 path[PATH_MAX], out[16384], want[128];
+	size_t			 i;
+	int			 s, c;
+
+	log_init(1, 0);
+	logger = &testlogger;
+	event_init();
+
+	tmpl_head = compile("<html>");
+	tmpl_search = compile("");
+	tmpl_search_header = compile("");
+	tmpl_search_result = compile("");
+	tmpl_foot = compile("</html>");
+
+	if (mkdtemp(dir) == NULL)
+		fatal("mkdtemp");
+	(void)snprintf(path, sizeof(path), "%s/sock", dir);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("bind %s", path);
+	if (listen(s, 8) == -1)
+		fatal("listen");
+
+	env.env_sockfd = s;
+	SPLAY_INIT(&env.env_fcgi_socks);
+
+	for (i = 0; i < NTESTS; ++i) {
+		if ((c = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			fatal("socket");
+		if (connect(c, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			fatal("connect %s", path);
+		fcgi_accept(env.env_sockfd, EV_READ, &env);
+
+		request(c, tests[i].script, tests[i].path, tests[i].query);
+		reply(c, out, sizeof(out));
+		close(c);
+
+		(void)snprintf(want, sizeof(want), "Content-Type: %s\r\n",
+		    tests[i].type);
+		if (strstr(out, want) == NULL)
+			fatalx("SCRIPT_NAME=%s PATH_INFO=%s QUERY_STRING=%s: "
+			    "not %s:\n%s", tests[i].script, tests[i].path,
+			    tests[i].query, tests[i].type, out);
+	}
+
+	close(s);
+	unlink(path);
+	rmdir(dir);
+
+	printf("format: %zu requests\n", NTESTS);
+	return (0);
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is in the public domain.
+ */
+
+/*
+ * Differential test of the HTML escaping: html_span, which scans a
+ * block at a time, against a byte-wise scan, and clt_putsan and
+ * clt_putmatch against the byte-wise escapers they replaced, on
+ * random strings made mostly of the characters that matter.
+ */
+
+#include "../fcgi.c"
+
+#define NRUNS	200000
+#define MAXLEN	300
+
+static const char alphabet[] = "<>&\"'\nab \xc3\xa9";
+
+static const char *pieces[] = {
+	"<strong>", "</strong>", "<stron", "</strong", "\n\n",
+};
+#define NPIECES	(sizeof(pieces) / sizeof(pieces[0]))
+
+static void
+ref_puts(struct evbuffer *b, const char *s)
+{
+	evbuffer_add(b, s, strlen(s));
+}
+
+static void
+ref_putsan(struct evbuffer *b, const char *s)
+{
+	for (; *s; ++s) {
+		switch (*s) {
+		case '<':
+			ref_puts(b, "&lt;");
+			break;
+		case '>':
+			ref_puts(b, "&gt;");
+			break;
+		case '&':
+			ref_puts(b, "&amp;");
+			break;
+		case '"':
+			ref_puts(b, "&quot;");
+			break;
+		case '\'':
+			ref_puts(b, "&apos;");
+			break;
+		default:
+			evbuffer_add(b, s, 1);
+			break;
+		}
+	}
+}
+
+static void
+ref_putmatch(struct evbuffer *b, const char *s)
+{
+	int	instrong = 0, intag = 0, lastnl = 0;
+
+	for (; *s; ++s) {
+		switch (*s) {
+		case '<':
+			if (!instrong && !strncmp(s, "<strong>", 8)) {
+				instrong = intag = 1;
+				evbuffer_add(b, s, 1);
+			} else if (instrong && !strncmp(s, "</strong>", 9)) {
+				instrong = 0;
+				intag = 1;
+				evbuffer_add(b, s, 1);
+			} else
+				ref_puts(b, "&lt;");
+			break;
+		case '>':
+			if (intag) {
+				intag = 0;
+				evbuffer_add(b, s, 1);
+			} else
+				ref_puts(b, "&gt;");
+			break;
+		case '&':
+			ref_puts(b, "&amp;");
+			break;
+		case '"':
+			ref_puts(b, "&quot;");
+			break;
+		case '\'':
+			ref_puts(b, "&apos;");
+			break;
+		case '\n':
+			if (lastnl)
+				break;
+			ref_puts(b, "<br />");
+			lastnl = 1;
+			break;
+		default:
+			lastnl = 0;
+			evbuffer_add(b, s, 1);
+			break;
+		}
+	}
+
+	if (instrong)
+		ref_puts(b, "</strong>");
+}
+
+/*
+ * A random string: long clean runs, so that the blocks are skipped,
+ * and the special characters and tags where they fall at any offset
+ * in a block.
+ */
+static void
+randstr(char *s, size_t *len)
+{
+	const char	*p;
+	size_t		 i = 0, n, want;
+
+	want = random() % MAXLEN;
+	while (i < want) {
+		switch (random() % 4) {
+		case 0:
+			n = random() % 40;
+			if (i + n > want)
+				n = want - i;
+			memset(s + i, 'x', n);
+			i += n;
+			break;
+		case 1:
+			p = pieces[random() % NPIECES];
+			n = strlen(p);
+			if (i + n > want)
+				n = want - i;
+			memcpy(s + i, p, n);
+			i += n;
+			break;
+		default:
+			s[i++] = alphabet[random() % (sizeof(alphabet) - 1)];
+			break;
+		}
+	}
+	s[i] = '\0';
+	*len = i;
+}
+
+static int
+check(const char *what, const char *s, struct evbuffer *got,
+    struct evbuffer *want)
+{
+	if (EVBUFFER_LENGTH(got) == EVBUFFER_LENGTH(want) &&
+	    !memcmp(EVBUFFER_DATA(got), EVBUFFER_DATA(want),
+	    EVBUFFER_LENGTH(got)))
+		return (0);
+
+	fprintf(stderr, "%s differs for \"%s\":\n  got  %.*s\n  want %.*s\n",
+	    what, s, (int)EVBUFFER_LENGTH(got), EVBUFFER_DATA(got),
+	    (int)EVBUFFER_LENGTH(want), EVBUFFER_DATA(want));
+	return (-1);
+}
+
+int
+main(void)
+{
+	struct fcgi	 fcgi;
+	struct client	 clt;
+	struct evbuffer	*want;
+	char		 s[MAXLEN + 1];
+	size_t		 len, i, j;
+	int		 nl, fail = 0;
+
+	log_init(1, 0);
+
+	memset(&fcgi, 0, sizeof(fcgi));
+	memset(&clt, 0, sizeof(clt));
+	clt.clt_fcgi = &fcgi;
+	if ((clt.clt_out = evbuffer_new()) == NULL ||
+	    (want = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
+
+	srandom(1);
+
+	for (i = 0; i < NRUNS && !fail; ++i) {
+		randstr(s, &len);
+
+		for (nl = 0; nl <= 1; ++nl) {
+			for (j = 0; j < len; ++j)
+				if (HTML_SPECIAL(s[j], nl))
+					break;
+			if (html_span(s, len, nl) != j) {
+				fprintf(stderr, "html_span(\"%s\", %d) is %zu,"
+				    " not %zu\n", s, nl,
+				    html_span(s, len, nl), j);
+				fail = 1;
+			}
+		}
+		if (fail)
+			break;
+
+		evbuffer_drain(clt.clt_out, EVBUFFER_LENGTH(clt.clt_out));
+		evbuffer_drain(want, EVBUFFER_LENGTH(want));
+		if (clt_putsan(&clt, s) == -1)
+			fatalx("clt_putsan failed");
+		ref_putsan(want, s);
+		if (check("clt_putsan", s, clt.clt_out, want) == -1)
+			fail = 1;
+
+		evbuffer_drain(clt.clt_out, EVBUFFER_LENGTH(clt.clt_out));
+		evbuffer_drain(want, EVBUFFER_LENGTH(want));
+		if (clt_putmatch(&clt, s) == -1)
+			fatalx("clt_putmatch failed");
+		ref_putmatch(want, s);
+		if (check("clt_putmatch", s, clt.clt_out, want) == -1)
+			fail = 1;
+	}
+
+	if (fail)
+		return (1);
+	printf("html: %d random strings ok\n", NRUNS);
+	return (0);
+}
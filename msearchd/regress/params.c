@@ -0,0 +1,190 @@
+/*
+ * This file is in the public domain.
+ */
+
+/*
+ * Microbenchmark of fcgi_parse_params on the PARAMS sent by nginx and
+ * by httpd(8) for a search.  Every parse is checked against the
+ * expected values, and the time per record is printed.
+ */
+
+#include <time.h>
+
+#include "../fcgi.c"
+
+#define NRUNS	1000000
+
+static const char *ua = "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+    "Gecko/20100101 Firefox/128.0";
+
+struct params {
+	const char	*ps_name;
+	const char	*ps_query;
+	const char	*ps_set[40][2];
+};
+
+static const struct params nginx = {
+	"nginx", "q=kernel+panic&sort=date", {
+	{ "QUERY_STRING",	"q=kernel+panic&sort=date" },
+	{ "REQUEST_METHOD",	"GET" },
+	{ "CONTENT_TYPE",	"" },
+	{ "CONTENT_LENGTH",	"" },
+	{ "SCRIPT_NAME",	"/search" },
+	{ "REQUEST_URI",	"/search?q=kernel+panic&sort=date" },
+	{ "DOCUMENT_URI",	"/search" },
+	{ "DOCUMENT_ROOT",	"/var/www/htdocs" },
+	{ "SERVER_PROTOCOL",	"HTTP/1.1" },
+	{ "REQUEST_SCHEME",	"https" },
+	{ "HTTPS",		"on" },
+	{ "GATEWAY_INTERFACE",	"CGI/1.1" },
+	{ "SERVER_SOFTWARE",	"nginx/1.26.2" },
+	{ "REMOTE_ADDR",	"2001:db8::1234:5678" },
+	{ "REMOTE_PORT",	"51234" },
+	{ "REMOTE_USER",	"" },
+	{ "SERVER_ADDR",	"2001:db8::1" },
+	{ "SERVER_PORT",	"443" },
+	{ "SERVER_NAME",	"marc.example.org" },
+	{ "REDIRECT_STATUS",	"200" },
+	{ "PATH_INFO",		"" },
+	{ "HTTP_HOST",		"marc.example.org" },
+	{ "HTTP_USER_AGENT",	NULL },
+	{ "HTTP_ACCEPT",	"text/html,application/xhtml+xml,"
+	    "application/xml;q=0.9,image/avif,image/webp,image/png,"
+	    "image/svg+xml,*/*;q=0.8" },
+	{ "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+	{ "HTTP_ACCEPT_ENCODING", "gzip, deflate, br, zstd" },
+	{ "HTTP_REFERER",	"https://marc.example.org/search?q=kernel" },
+	{ "HTTP_CONNECTION",	"keep-alive" },
+	{ "HTTP_UPGRADE_INSECURE_REQUESTS", "1" },
+	{ "HTTP_SEC_FETCH_DEST", "document" },
+	{ "HTTP_SEC_FETCH_MODE", "navigate" },
+	{ "HTTP_SEC_FETCH_SITE", "same-origin" },
+	{ "HTTP_SEC_FETCH_USER", "?1" },
+	{ "HTTP_PRIORITY",	"u=0, i" },
+	{ NULL,			NULL } }
+};
+
+static const struct params httpd = {
+	"httpd", "q=kernel+panic", {
+	{ "DOCUMENT_ROOT",	"/smarc" },
+	{ "GATEWAY_INTERFACE",	"CGI/1.1" },
+	{ "HTTP_ACCEPT",	"text/html,application/xhtml+xml,"
+	    "application/xml;q=0.9,*/*;q=0.8" },
+	{ "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+	{ "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+	{ "HTTP_CONNECTION",	"keep-alive" },
+	{ "HTTP_HOST",		"marc.example.org" },
+	{ "HTTP_USER_AGENT",	NULL },
+	{ "PATH_INFO",		"" },
+	{ "SCRIPT_NAME",	"/search" },
+	{ "SCRIPT_FILENAME",	"/smarc/search" },
+	{ "QUERY_STRING",	"q=kernel+panic" },
+	{ "REMOTE_ADDR",	"192.0.2.10" },
+	{ "REMOTE_PORT",	"40123" },
+	{ "REQUEST_METHOD",	"GET" },
+	{ "REQUEST_URI",	"/search?q=kernel+panic" },
+	{ "SERVER_ADDR",	"192.0.2.1" },
+	{ "SERVER_PORT",	"443" },
+	{ "SERVER_NAME",	"marc.example.org" },
+	{ "SERVER_PROTOCOL",	"HTTP/1.1" },
+	{ "SERVER_SOFTWARE",	"OpenBSD httpd" },
+	{ "HTTPS",		"on" },
+	{ "TLS_PEER_VERIFY",	"0" },
+	{ NULL,			NULL } }
+};
+
+static size_t
+put_len(unsigned char *p, size_t len)
+{
+	if (len < 128) {
+		p[0] = len;
+		return (1);
+	}
+	p[0] = 0x80 | (len >> 24);
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+	return (4);
+}
+
+static size_t
+put(unsigned char *p, const char *name, const char *val)
+{
+	size_t		 nl = strlen(name), vl = strlen(val), off = 0;
+
+	off += put_len(p + off, nl);
+	off += put_len(p + off, vl);
+	memcpy(p + off, name, nl);
+	off += nl;
+	memcpy(p + off, val, vl);
+	return (off + vl);
+}
+
+static void
+check(const struct params *ps, struct client *clt)
+{
+	if (clt->clt_server_name == NULL || clt->clt_script_name == NULL ||
+	    clt->clt_path_info == NULL || clt->clt_query == NULL ||
+	    strcmp(clt->clt_server_name, "marc.example.org") != 0 ||
+	    strcmp(clt->clt_script_name, "/search/") != 0 ||
+	    strcmp(clt->clt_path_info, "/") != 0 ||
+	    strcmp(clt->clt_query, ps->ps_query) != 0 ||
+	    clt->clt_method != METHOD_GET)
+		fatalx("%s: wrong parameters", ps->ps_name);
+}
+
+static void
+run(const struct params *ps)
+{
+	struct evbuffer		*src;
+	struct fcgi		 fcgi;
+	struct client		 clt;
+	struct timespec		 start, end;
+	unsigned char		 rec[FCGI_MAX_CONTENT];
+	const char		*v;
+	double			 ns;
+	size_t			 len = 0;
+	int			 i, np;
+
+	for (np = 0; ps->ps_set[np][0] != NULL; ++np) {
+		if ((v = ps->ps_set[np][1]) == NULL)
+			v = ua;
+		len += put(rec + len, ps->ps_set[np][0], v);
+	}
+
+	if ((src = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
+	memset(&fcgi, 0, sizeof(fcgi));
+	memset(&clt, 0, sizeof(clt));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NRUNS; ++i) {
+		if (evbuffer_add(src, rec, len) == -1)
+			fatal("evbuffer_add");
+		fcgi.fcg_toread = len;
+		clt.clt_method = METHOD_UNKNOWN;
+		if (fcgi_parse_params(&fcgi, src, &clt) == -1)
+			fatalx("%s: fcgi_parse_params failed", ps->ps_name);
+		check(ps, &clt);
+		arena_reset(&clt.clt_arena);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec);
+	printf("params: %s: %d parameters, %zu bytes: %.0f ns/record\n",
+	    ps->ps_name, np, len, ns / NRUNS);
+
+	arena_free(&clt.clt_arena);
+	evbuffer_free(src);
+}
+
+int
+main(void)
+{
+	log_init(1, 0);
+
+	run(&nginx);
+	run(&httpd);
+	return (0);
+}
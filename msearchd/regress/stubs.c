@@ -0,0 +1,68 @@
+/*
+ * This file is in the public domain.
+ */
+
+/*
+ * What fcgi.c needs from the rest of msearchd, for the tests that
+ * include it.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "msearchd.h"
+
+int	accept_serial;
+
+int
+server_handle(struct env *env, struct client *clt)
+{
+	if (clt_puts(clt, "Content-Type: text/plain\r\n\r\nok\n") == -1)
+		return (-1);
+	return (fcgi_end_request(clt, 0));
+}
+
+int
+server_resume(struct client *clt)
+{
+	return (0);
+}
+
+void
+server_client_free(struct client *clt)
+{
+	clt_free(clt);
+}
+
+uint64_t
+stats_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+void
+stats_count(int c)
+{
+}
+
+void
+stats_inflight(int n)
+{
+}
+
+void
+stats_busy(int n)
+{
+}
+
+void
+stats_observe(int h, uint64_t v)
+{
+}
@@ -1,2 +1,29 @@
-create virtual table email using fts5(mid UNINDEXED, from, date, subj, body,
+create table mail (
+	id	integer primary key,
+	mid	text not null unique,
+	"from"	text not null,
+	date	integer not null,
+	subj	text not null,
+	body	text not null
+);
+create index mail_date on mail(date);
+create index mail_from on mail("from");
+
+create virtual table email using fts5("from", subj, body,
+	content = 'mail', content_rowid = 'id',
 	tokenize = 'porter unicode61 remove_diacritics 2');
+
+create trigger mail_ai after insert on mail begin
+	insert into email(rowid, "from", subj, body)
+	    values (new.id, new."from", new.subj, new.body);
+end;
+create trigger mail_ad after delete on mail begin
+	insert into email(email, rowid, "from", subj, body)
+	    values ('delete', old.id, old."from", old.subj, old.body);
+end;
+create trigger mail_au after update on mail begin
+	insert into email(email, rowid, "from", subj, body)
+	    values ('delete', old.id, old."from", old.subj, old.body);
+	insert into email(rowid, "from", subj, body)
+	    values (new.id, new."from", new.subj, new.body);
+end;
@@ -2,15 +2,21 @@
  * This file is in the public domain.
  */
 
+#include <sys/queue.h>
+#include <sys/stat.h>
 #include <sys/tree.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <event.h>
 #include <libgen.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sqlite3.h>
@@ -18,15 +24,79 @@
 #include "log.h"
 #include "msearchd.h"
 
+/*
+ * Pages are addressed by the (rank, date, rowid) key of the last or
+ * first row shown rather than by an OFFSET, so that deep pages cost
+ * the same as the first one.
+ */
+#define CURSOR_FMT	"%016llx.%lld.%lld"
+
+/* how many virtual machine instructions between deadline checks */
+#define PROGRESS_STEPS	1000
+
+/* seconds between checks for changes to the database */
+#define WATCH_INTERVAL	1
+
+#define COUNT_CACHE	64	/* entries */
+#define COUNT_KEYLEN	(QUERY_MAXLEN + 48)
+
+/* the finished jobs kept for the next searches, with their arena */
+#define JOB_FREE_MAX	16
+#define JOB_ARENA_CHUNK	(64 * 1024)	/* usually a whole page */
+
+/*
+ * email is the full text index over the mail table, which holds the
+ * contents and the metadata.  A search is done in two steps: first
+ * the rows of the page are found, ranking them only when sorting by
+ * relevance (see rank.c), then the columns to show and the excerpt
+ * are fetched for those rows alone, instead of for all the rows that
+ * went through the sorter.
+ */
+#define PAGE_FROM	" from email join mail m on m.id = email.rowid"
+
+#define ROW_COLS							\
+	"select m.id, m.mid, m.\"from\", m.subj,"			\
+	"  snippet(email, 2, '<strong>', '</strong>', '...', 32)"	\
+	" from email join mail m on m.id = email.rowid"			\
+	" where email match ?"
+#define ROW_QUERY	ROW_COLS " and email.rowid = ?"
+#define RANGE_QUERY	ROW_COLS " and email.rowid between ? and ?"
+
+/*
+ * Cached results are prefixed by this, so that the navigation links
+ * can be rendered with the query of the current request.
+ */
+struct pagenav {
+	struct cursor	 pn_first;
+	struct cursor	 pn_last;
+	int		 pn_prev;
+	int		 pn_next;
+};
+
+/*
+ * The number of matches is the same for all the pages of a search, so
+ * it's kept in a small direct-mapped cache of each connection to the
+ * database and not counted again when going through the pages.  It's
+ * dropped with the connection when the database is reopened.
+ */
+struct count_ent {
+	uint32_t	 ce_hash;
+	int64_t		 ce_count;
+	int		 ce_exact;
+	char		 ce_key[COUNT_KEYLEN];
+};
+
 char		dbpath[PATH_MAX];
 
+static struct jobs	job_free_list = TAILQ_HEAD_INITIALIZER(job_free_list);
+static int		job_nfree;
+
 void		 server_sig_handler(int, short, void *);
-void		 server_open_db(struct env *);
-void		 server_close_db(struct env *);
+void		 server_reload(struct env *, int);
 __dead void	 server_shutdown(struct env *);
 int		 server_reply(struct client *, int, const char *);
 int		 server_urldecode(char *);
-char		*server_getquery(struct client *);
+void		 server_getquery(struct client *, struct query *);
 
 void
 server_sig_handler(int sig, short ev, void *arg)
@@ -41,72 +111,393 @@ server_sig_handler(int sig, short ev, void *arg)
 	switch (sig) {
 	case SIGHUP:
 		log_info("re-opening the db");
-		server_close_db(env);
-		server_open_db(env);
+		log_info("cache: %llu hits, %llu misses;"
+		    " shared cache: %llu hits, %llu misses",
+		    (unsigned long long)env->env_cache.c_hits,
+		    (unsigned long long)env->env_cache.c_misses,
+		    (unsigned long long)env->env_shcache.sc_hits,
+		    (unsigned long long)env->env_shcache.sc_misses);
+		log_info("%llu searches truncated",
+		    (unsigned long long)env->env_truncated);
+		server_reload(env, 1);
 		break;
 	case SIGTERM:
 	case SIGINT:
 		server_shutdown(env);
 		break;
+	case SIGUSR1:
+		log_info("retiring");
+		fcgi_retire(env);
+		break;
 	default:
 		fatalx("unexpected signal %d", sig);
 	}
 }
 
-static inline void
-loadstmt(sqlite3 *db, sqlite3_stmt **stmt, const char *sql)
+/*
+ * Return the prepared statement for the given shape, building it
+ * the first time.
+ */
+static sqlite3_stmt *
+server_stmt(struct dbconn *dbc, int shape)
 {
-	int	err;
+	char		 sql[512];
+	const char	*rank, *cursor = "", *order;
+	int		 err;
+
+	if (dbc->dbc_stmts[shape] != NULL)
+		return (dbc->dbc_stmts[shape]);
+
+	if (shape & QS_COUNT) {
+		/* the join is needed only to filter by date */
+		(void)snprintf(sql, sizeof(sql), "select count(*)%s"
+		    " where email match ?%s%s",
+		    (shape & (QS_DATEMIN|QS_DATEMAX)) ? PAGE_FROM :
+		    " from email",
+		    (shape & QS_DATEMIN) ? " and m.date >= ?" : "",
+		    (shape & QS_DATEMAX) ? " and m.date < ?" : "");
+		goto prepare;
+	}
+
+	if (shape & QS_BYDATE) {
+		/*
+		 * Walking the index by descending rowid, which follows
+		 * the order in which the mails were imported, allows
+		 * to stop as soon as the page is full.
+		 */
+		rank = "0.0";
+		if (shape & QS_AFTER)
+			cursor = " and email.rowid < ?";
+		else if (shape & QS_BEFORE)
+			cursor = " and email.rowid > ?";
+		if (shape & QS_BEFORE)
+			order = " order by email.rowid";
+		else
+			order = " order by email.rowid desc";
+	} else {
+		rank = "msrank(email, m.date)";
+		if (shape & QS_AFTER)
+			cursor = " and (r, m.date, m.id) > (?, ?, ?)";
+		else if (shape & QS_BEFORE)
+			cursor = " and (r, m.date, m.id) < (?, ?, ?)";
+		if (shape & QS_BEFORE)
+			order = " order by r desc, m.date desc, m.id desc";
+		else
+			order = " order by r, m.date, m.id";
+	}
 
-	err = sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
-	if (err != SQLITE_OK)
-		fatalx("failed to prepare statement \"%s\": %s",
-		    sql, sqlite3_errstr(err));
+	(void)snprintf(sql, sizeof(sql), "select m.id, %s as r, m.date"
+	    PAGE_FROM " where email match ?%s%s%s%s limit ?", rank,
+	    (shape & QS_DATEMIN) ? " and m.date >= ?" : "",
+	    (shape & QS_DATEMAX) ? " and m.date < ?" : "",
+	    cursor, order);
+
+prepare:
+	err = sqlite3_prepare_v2(dbc->dbc_db, sql, -1, &dbc->dbc_stmts[shape],
+	    NULL);
+	if (err != SQLITE_OK) {
+		log_warnx("failed to prepare statement \"%s\": %s",
+		    sql, sqlite3_errmsg(dbc->dbc_db));
+		return (NULL);
+	}
+	return (dbc->dbc_stmts[shape]);
 }
 
-void
-server_open_db(struct env *env)
+/*
+ * Interrupt the running statement once the deadline is passed.
+ */
+static int
+server_progress(void *arg)
+{
+	struct dbconn	*dbc = arg;
+	struct timespec	 now;
+
+	if (dbc->dbc_deadline.tv_sec == 0)
+		return (0);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec != dbc->dbc_deadline.tv_sec)
+		return (now.tv_sec > dbc->dbc_deadline.tv_sec);
+	return (now.tv_nsec >= dbc->dbc_deadline.tv_nsec);
+}
+
+static int
+server_pragma(sqlite3 *db, const char *name, long long val)
+{
+	char		 sql[64];
+	char		*errmsg;
+
+	(void)snprintf(sql, sizeof(sql), "pragma %s = %lld", name, val);
+	if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_warnx("%s: %s", sql, errmsg);
+		sqlite3_free(errmsg);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Called by the worker threads too, with SQLITE_OPEN_NOMUTEX in flags
+ * since each connection is used only by one thread.
+ */
+int
+server_open_db(struct dbconn *dbc, int flags)
 {
 	int	err;
 
-	err = sqlite3_open_v2(dbpath, &env->env_db,
-	    SQLITE_OPEN_READONLY, NULL);
-	if (err != SQLITE_OK)
-		fatalx("can't open database %s: %s", dbpath,
-		    sqlite3_errmsg(env->env_db));
+	memset(dbc, 0, sizeof(*dbc));
+
+	err = sqlite3_open_v2(dbpath, &dbc->dbc_db,
+	    SQLITE_OPEN_READONLY | flags, NULL);
+	if (err != SQLITE_OK) {
+		log_warnx("can't open database %s: %s", dbpath,
+		    sqlite3_errmsg(dbc->dbc_db));
+		goto err;
+	}
+
+	sqlite3_progress_handler(dbc->dbc_db, PROGRESS_STEPS, server_progress,
+	    dbc);
+
+	/* a negative cache_size is in KiB rather than in pages */
+	if ((mmap_mb != 0 && server_pragma(dbc->dbc_db, "mmap_size",
+	    (long long)mmap_mb * 1024 * 1024) == -1) ||
+	    (dbcache_kb != 0 && server_pragma(dbc->dbc_db, "cache_size",
+	    -(long long)dbcache_kb) == -1))
+		goto err;
+
+	if ((dbc->dbc_rank = rank_register(dbc->dbc_db)) == NULL) {
+		log_warnx("can't register the ranking function");
+		goto err;
+	}
+
+	/* the other shapes are prepared on demand */
+	if (server_stmt(dbc, 0) == NULL) {
+		log_warnx("can't prepare the queries for %s", dbpath);
+		goto err;
+	}
+
+	err = sqlite3_prepare_v2(dbc->dbc_db, ROW_QUERY, -1, &dbc->dbc_row,
+	    NULL);
+	if (err != SQLITE_OK) {
+		log_warnx("failed to prepare statement \"%s\": %s",
+		    ROW_QUERY, sqlite3_errmsg(dbc->dbc_db));
+		goto err;
+	}
+
+	err = sqlite3_prepare_v2(dbc->dbc_db, RANGE_QUERY, -1,
+	    &dbc->dbc_range, NULL);
+	if (err != SQLITE_OK) {
+		log_warnx("failed to prepare statement \"%s\": %s",
+		    RANGE_QUERY, sqlite3_errmsg(dbc->dbc_db));
+		goto err;
+	}
+
+	/* without it there's no estimate of the number of results */
+	if ((dbc->dbc_vocab = vocab_open(dbc->dbc_db)) == NULL)
+		log_warnx("can't estimate the number of results");
+
+	if ((dbc->dbc_counts = calloc(COUNT_CACHE,
+	    sizeof(*dbc->dbc_counts))) == NULL)
+		log_warn("%s: calloc", __func__);
+	return (0);
+
+err:
+	server_close_db(dbc);
+	return (-1);
+}
+
+/*
+ * Open the database again, and only then close the old connection,
+ * which is kept if that fails.
+ */
+int
+server_reopen_db(struct dbconn *dbc, int flags)
+{
+	struct dbconn	 ndbc;
+
+	if (server_open_db(&ndbc, flags) == -1)
+		return (-1);
+
+	server_close_db(dbc);
+	*dbc = ndbc;
+	sqlite3_progress_handler(dbc->dbc_db, PROGRESS_STEPS, server_progress,
+	    dbc);
+	return (0);
+}
 
-	loadstmt(env->env_db, &env->env_query,
-	    "select mid, \"from\", date, subj,"
-	    "  snippet(email, 4, '<strong>', '</strong>', '...', 32)"
-	    " from email"
-	    " where email match ?"
-	    " order by rank, date"
-	    " limit 100");
+/*
+ * Have the connection search the mails added since it was opened or
+ * last refreshed: SQLite already sees them, but the newest date used
+ * by the ranking, the statistics of the estimates and the counts of
+ * the results are computed again.
+ */
+static void
+server_refresh_db(struct dbconn *dbc)
+{
+	dbc->dbc_stale = 0;
+	rank_refresh(dbc->dbc_rank, dbc->dbc_db);
+	if (vocab_refresh(dbc->dbc_vocab) == -1)
+		log_warnx("can't estimate the number of new results");
+	if (dbc->dbc_counts != NULL)
+		memset(dbc->dbc_counts, 0,
+		    COUNT_CACHE * sizeof(*dbc->dbc_counts));
 }
 
 void
-server_close_db(struct env *env)
+server_close_db(struct dbconn *dbc)
 {
+	size_t	i;
 	int	err;
 
-	sqlite3_finalize(env->env_query);
+	for (i = 0; i < QS__MAX; ++i)
+		sqlite3_finalize(dbc->dbc_stmts[i]);
+	sqlite3_finalize(dbc->dbc_row);
+	sqlite3_finalize(dbc->dbc_range);
+	vocab_close(dbc->dbc_vocab);
+	free(dbc->dbc_counts);
 
-	if ((err = sqlite3_close(env->env_db)) != SQLITE_OK)
+	if ((err = sqlite3_close(dbc->dbc_db)) != SQLITE_OK)
 		log_warnx("sqlite3_close %s", sqlite3_errstr(err));
+	memset(dbc, 0, sizeof(*dbc));
+}
+
+static void
+server_watch_close(struct dbwatch *dw)
+{
+	sqlite3_finalize(dw->dw_version);
+	sqlite3_close(dw->dw_db);
+	dw->dw_version = NULL;
+	dw->dw_db = NULL;
+}
+
+static int
+server_watch_version(struct dbwatch *dw, int64_t *version)
+{
+	int		 err;
+
+	err = sqlite3_step(dw->dw_version);
+	if (err == SQLITE_ROW)
+		*version = sqlite3_column_int64(dw->dw_version, 0);
+	sqlite3_reset(dw->dw_version);
+	return (err == SQLITE_ROW ? 0 : -1);
+}
+
+/*
+ * The database is watched through a connection of its own: the file
+ * at dbpath being replaced means a new database was published, and
+ * its data_version changing that someone else committed to it.
+ */
+static int
+server_watch_open(struct dbwatch *dw)
+{
+	struct stat	 sb;
+	int		 err;
+
+	if (stat(dbpath, &sb) == -1) {
+		log_warn("stat %s", dbpath);
+		return (-1);
+	}
+	dw->dw_dev = sb.st_dev;
+	dw->dw_ino = sb.st_ino;
+
+	err = sqlite3_open_v2(dbpath, &dw->dw_db, SQLITE_OPEN_READONLY, NULL);
+	if (err == SQLITE_OK)
+		err = sqlite3_prepare_v2(dw->dw_db, "pragma data_version", -1,
+		    &dw->dw_version, NULL);
+	if (err != SQLITE_OK ||
+	    server_watch_version(dw, &dw->dw_gen) == -1) {
+		log_warnx("can't watch %s: %s", dbpath,
+		    sqlite3_errmsg(dw->dw_db));
+		server_watch_close(dw);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+server_watch(int fd, short ev, void *arg)
+{
+	struct env	*env = arg;
+	struct dbwatch	*dw = &env->env_watch;
+	struct timeval	 tv = { WATCH_INTERVAL, 0 };
+	struct stat	 sb;
+	int64_t		 gen;
+
+	evtimer_add(&dw->dw_ev, &tv);
+
+	if (dw->dw_db == NULL) {
+		if (server_watch_open(dw) == -1)
+			return;
+		log_info("database available again");
+	} else if (stat(dbpath, &sb) == -1) {
+		/* in the middle of being replaced, or gone */
+		return;
+	} else if (sb.st_dev != dw->dw_dev || sb.st_ino != dw->dw_ino) {
+		log_info("new database file");
+	} else if (server_watch_version(dw, &gen) == -1 ||
+	    gen == dw->dw_gen) {
+		/* busy or unchanged */
+		return;
+	} else {
+		log_debug("database changed");
+		dw->dw_gen = gen;
+		server_reload(env, 0);
+		return;
+	}
+
+	server_reload(env, 1);
+}
+
+/*
+ * Have the new contents of the database searched, and the cached
+ * results computed before ignored.  Mails added to the same file are
+ * seen by the open connections, which only refresh what depends on
+ * them before their next search.  Another file is only seen by new
+ * connections: with reopen they are opened again.
+ */
+void
+server_reload(struct env *env, int reopen)
+{
+	struct dbwatch	*dw = &env->env_watch;
+
+	cache_expire(&env->env_cache);
+	shcache_reload(&env->env_shcache);
+
+	if (!reopen) {
+		if (workers == 0)
+			env->env_dbc.dbc_stale = 1;
+		else
+			pool_reload(0);
+		return;
+	}
+
+	if (dw->dw_db != NULL)
+		server_watch_close(dw);
+	(void)server_watch_open(dw);
+
+	if (workers == 0) {
+		if (server_reopen_db(&env->env_dbc, 0) == -1)
+			log_warnx("keeping the old database");
+	} else
+		pool_reload(1);
 }
 
 int
-server_main(const char *db)
+server_main(const char *db, int slot)
 {
 	char		 path[PATH_MAX], *parent;
 	struct env	 env;
 	struct event	 sighup;
 	struct event	 sigint;
 	struct event	 sigterm;
+	struct event	 sigusr1;
+	struct timeval	 tv = { WATCH_INTERVAL, 0 };
+	int		 i, r;
 
 	signal(SIGPIPE, SIG_IGN);
 
 	memset(&env, 0, sizeof(env));
+	env.env_slot = slot;
 
 	if (realpath(db, dbpath) == NULL)
 		fatal("realpath %s", db);
@@ -116,14 +507,35 @@ server_main(const char *db)
 	if (unveil(parent, "r") == -1)
 		fatal("unveil(%s, r)", parent);
 
+	/* readers of a database in WAL mode write to the -shm file */
+	for (i = 0; i < 2; ++i) {
+		r = snprintf(path, sizeof(path), "%s-%s", dbpath,
+		    i == 0 ? "wal" : "shm");
+		if (r < 0 || (size_t)r >= sizeof(path))
+			fatalx("path too long: %s", dbpath);
+		if (unveil(path, "rwc") == -1)
+			fatal("unveil(%s, rwc)", path);
+	}
+
 	/*
 	 * rpath flock: sqlite3
+	 * wpath cpath: sqlite3, only the -wal and -shm files
 	 * unix: accept(2)
 	 */
-	if (pledge("stdio rpath flock unix", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath flock unix", NULL) == -1)
 		fatal("pledge");
 
-	server_open_db(&env);
+	if (workers == 0 && server_open_db(&env.env_dbc, 0) == -1)
+		fatalx("can't open the database");
+	(void)server_watch_open(&env.env_watch);
+	cache_init(&env.env_cache, cache_size);
+	if ((env.env_hit = evbuffer_new()) == NULL)
+		fatal("evbuffer_new");
+	if (shcache_kb != 0 &&
+	    shcache_attach(&env.env_shcache, SHCACHE_FD) == -1)
+		log_warnx("running without the shared cache");
+	if (stats_attach(STATS_FD, slot) == -1)
+		log_warnx("running without stats");
 
 	event_init();
 
@@ -131,17 +543,32 @@ server_main(const char *db)
 
 	event_set(&env.env_sockev, env.env_sockfd, EV_READ|EV_PERSIST,
 	    fcgi_accept, &env);
-	event_add(&env.env_sockev, NULL);
+	if (accept_serial) {
+		event_set(&env.env_turnev, ACCEPT_IN_FD, EV_READ|EV_PERSIST,
+		    fcgi_take_turn, &env);
+		event_add(&env.env_turnev, NULL);
+	} else
+		event_add(&env.env_sockev, NULL);
 
 	evtimer_set(&env.env_pausev, fcgi_accept, &env);
 
+	evtimer_set(&env.env_watch.dw_ev, server_watch, &env);
+	evtimer_add(&env.env_watch.dw_ev, &tv);
+
+	if (workers != 0 && pool_init(&env, workers) == -1)
+		fatalx("can't start the worker threads");
+
 	signal_set(&sighup, SIGHUP, server_sig_handler, &env);
 	signal_set(&sigint, SIGINT, server_sig_handler, &env);
 	signal_set(&sigterm, SIGTERM, server_sig_handler, &env);
+	signal_set(&sigusr1, SIGUSR1, server_sig_handler, &env);
 
 	signal_add(&sighup, NULL);
 	signal_add(&sigint, NULL);
 	signal_add(&sigterm, NULL);
+	signal_add(&sigusr1, NULL);
+
+	server_warmup();
 
 	log_info("ready");
 	event_dispatch();
@@ -153,7 +580,9 @@ void __dead
 server_shutdown(struct env *env)
 {
 	log_info("shutting down");
-	server_close_db(env);
+	cache_flush(&env->env_cache);
+	if (env->env_dbc.dbc_db != NULL)
+		server_close_db(&env->env_dbc);
 	exit(0);
 }
 
@@ -219,208 +648,1351 @@ server_urldecode(char *s)
 	return (0);
 }
 
-char *
-server_getquery(struct client *clt)
+static int
+cursor_parse(const char *s, struct cursor *cur)
+{
+	unsigned long long	 bits;
+	char			*ep;
+
+	errno = 0;
+	bits = strtoull(s, &ep, 16);
+	if (ep == s || *ep != '.' || errno == ERANGE)
+		return (-1);
+	memcpy(&cur->cur_rank, &bits, sizeof(cur->cur_rank));
+
+	s = ep + 1;
+	cur->cur_date = strtoll(s, &ep, 10);
+	if (ep == s || *ep != '.' || errno == ERANGE)
+		return (-1);
+
+	s = ep + 1;
+	cur->cur_rowid = strtoll(s, &ep, 10);
+	if (ep == s || *ep != '\0' || errno == ERANGE)
+		return (-1);
+
+	return (0);
+}
+
+static int
+cursor_fmt(const struct cursor *cur, char *buf, size_t bufsize)
+{
+	unsigned long long	 bits;
+	int			 r;
+
+	memcpy(&bits, &cur->cur_rank, sizeof(bits));
+	r = snprintf(buf, bufsize, CURSOR_FMT, bits,
+	    (long long)cur->cur_date, (long long)cur->cur_rowid);
+	if (r < 0 || (size_t)r >= bufsize)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Whether s ends in suffix, not counting a trailing slash: the script
+ * name always gets one from fcgi_parse_params.
+ */
+static int
+has_suffix(const char *s, const char *suffix)
+{
+	size_t		 len, slen;
+
+	if (s == NULL)
+		return (0);
+	len = strlen(s);
+	if (len > 0 && s[len - 1] == '/')
+		len--;
+	slen = strlen(suffix);
+	return (len >= slen && !strncmp(s + len - slen, suffix, slen));
+}
+
+void
+server_getquery(struct client *clt, struct query *q)
 {
-	char	*tmp, *field;
+	const char	*errstr;
+	char		*tmp, *field;
+
+	memset(q, 0, sizeof(*q));
+	q->q_page = 1;
+	q->q_dir = PAGE_FIRST;
+	if (has_suffix(clt->clt_script_name, ".json") ||
+	    has_suffix(clt->clt_path_info, ".json"))
+		q->q_format = FORMAT_JSON;
 
 	tmp = clt->clt_query;
 	while ((field = strsep(&tmp, "&")) != NULL) {
 		if (server_urldecode(field) == -1)
 			continue;
 
-		if (!strncmp(field, "q=", 2))
-			return (field + 2);
-		log_info("unknown query param %s", field);
-	}
-
-	return (NULL);
-}
+		if (!strncmp(field, "q=", 2)) {
+			q->q_text = field + 2;
+			continue;
+		}
 
-static inline int
-fts_escape(const char *p, char *buf, size_t bufsize)
-{
-	char		*q;
+		if (!strncmp(field, "page=", 5)) {
+			q->q_page = strtonum(field + 5, 1, INT_MAX, &errstr);
+			if (errstr) {
+				log_info("page number is %s: %s", errstr,
+				    field + 5);
+				q->q_page = 1;
+			}
+			continue;
+		}
 
-	/*
-	 * split p into words and quote them into buf.
-	 * quoting means wrapping each word into "..." and
-	 * replace every " with "".
-	 * i.e. 'C++ "framework"' -> '"C++" """framework"""'
-	 * flatting all the whitespaces seems fine too.
-	 */
+		if (!strncmp(field, "format=", 7)) {
+			if (!strcmp(field + 7, "json"))
+				q->q_format = FORMAT_JSON;
+			else if (!strcmp(field + 7, "html"))
+				q->q_format = FORMAT_HTML;
+			else
+				log_info("unknown format %s", field + 7);
+			continue;
+		}
 
-	q = buf;
-	while (bufsize != 0) {
-		p += strspn(p, " \f\n\r\t\v");
-		if (*p == '\0')
-			break;
+		if (!strncmp(field, "sort=", 5)) {
+			if (!strcmp(field + 5, "date"))
+				q->q_sort = SORT_DATE;
+			else if (!strcmp(field + 5, "rank"))
+				q->q_sort = SORT_RANK;
+			else
+				log_info("unknown sort order %s", field + 5);
+			continue;
+		}
 
-		*q++ = '"';
-		bufsize--;
-		while (*p && !isspace((unsigned char)*p) && bufsize != 0) {
-			if (*p == '"') { /* double the quote character */
-				*q++ = '"';
-				if (--bufsize == 0)
-					break;
+		if (!strncmp(field, "after=", 6) ||
+		    !strncmp(field, "before=", 7)) {
+			q->q_dir = *field == 'a' ? PAGE_AFTER : PAGE_BEFORE;
+			if (cursor_parse(strchr(field, '=') + 1,
+			    &q->q_cursor) == -1) {
+				log_info("invalid cursor %s", field);
+				q->q_dir = PAGE_FIRST;
 			}
-			*q++ = *p++;
-			bufsize--;
+			continue;
 		}
 
-		if (bufsize < 2)
-			break;
-		*q++ = '"';
-		*q++ = ' ';
-		bufsize -= 2;
-	}
-	if ((*p == '\0') && bufsize != 0) {
-		*q = '\0';
-		return (0);
+		log_info("unknown query param %s", field);
 	}
-	return (-1);
+
+	if (q->q_dir == PAGE_FIRST)
+		q->q_page = 1;
 }
 
+/*
+ * Append s, len bytes long, to buf as an FTS5 string: wrapped in
+ * double quotes and with every double quote doubled.
+ */
 static int
-render_tmpl(struct client *clt, const char *tmpl,
-    const char *var, const char *val)
+fts_quote(char **buf, size_t *bufsize, const char *s, size_t len)
 {
-	const char	*t;
-	size_t		 vlen;
+	char		*q = *buf;
+	size_t		 left = *bufsize;
 
-	if (var == NULL)
-		return (clt_puts(clt, tmpl));
+	if (left < 1)
+		return (-1);
+	*q++ = '"';
+	left--;
 
-	vlen = strlen(var);
-	while ((t = strstr(tmpl, var)) != NULL) {
-		if (clt_write(clt, tmpl, t - tmpl) == -1 ||
-		    clt_putsan(clt, val) == -1)
+	for (; len > 0; ++s, --len) {
+		if (left < 2)
 			return (-1);
-		tmpl = t + vlen;
+		if (*s == '"') {
+			*q++ = '"';
+			left--;
+		}
+		*q++ = *s;
+		left--;
 	}
 
-	return (clt_puts(clt, tmpl));
+	if (left < 2)
+		return (-1);
+	*q++ = '"';
+	*q++ = ' ';
+	left -= 2;
+
+	*buf = q;
+	*bufsize = left;
+	return (0);
 }
 
-int
-server_handle(struct env *env, struct client *clt)
+static int
+parse_date(const char *s, size_t len, int64_t *ret)
 {
-	char		 dbuf[64];
-	char		 esc[QUERY_MAXLEN];
-	char		*query;
-	const char	*mid, *from, *subj, *snip;
-	uint64_t	 date;
-	time_t		 d;
-	struct tm	*tm;
-	int		 err, have_results = 0;
-
-	if ((query = server_getquery(clt)) != NULL &&
-	    fts_escape(query, esc, sizeof(esc)) != -1 &&
-	    *esc != '\0') {
-		log_debug("searching for %s", esc);
-
-		err = sqlite3_bind_text(env->env_query, 1, esc, -1, NULL);
-		if (err != SQLITE_OK) {
-			sqlite3_reset(env->env_query);
-			if (server_reply(clt, 500, "text/plain") == -1)
-				return (-1);
-			if (clt_puts(clt, "Internal server error\n") == -1)
-				return (-1);
-			return (fcgi_end_request(clt, 1));
-		}
-	} else
-		query = NULL;
-
-	if (server_reply(clt, 200, "text/html") == -1)
-		goto err;
+	struct tm	 tm;
+	char		 buf[16];
+	const char	*ep;
 
-	if (render_tmpl(clt, tmpl_head, "TITLE", "Search") == -1 ||
-	    render_tmpl(clt, tmpl_search_header, NULL, NULL) == -1 ||
-	    render_tmpl(clt, tmpl_search, "QUERY", query) == -1)
-		goto err;
+	if (len >= sizeof(buf))
+		return (-1);
+	memcpy(buf, s, len);
+	buf[len] = '\0';
 
-	if (query == NULL)
-		goto done;
+	memset(&tm, 0, sizeof(tm));
+	if ((ep = strptime(buf, "%Y-%m-%d", &tm)) == NULL || *ep != '\0')
+		return (-1);
+	*ret = timegm(&tm);
+	return (0);
+}
 
-	if (clt_puts(clt, "<div class='thread'><ul>") == -1)
-		goto err;
+/*
+ * Translate the query in an FTS5 expression.  Words are quoted, as
+ * are phrases between double quotes.  "from:" and "subject:" restrict
+ * the following word or phrase to that column, "after:" and
+ * "before:" take a YYYY-MM-DD date and filter by the date of the
+ * mail.  For example
+ *
+ *	C++ from:op "fts5 column" before:2023-01-01
+ *
+ * becomes '"C++" {from} : "op" "fts5 column" ' with a date filter.
+ */
+static int
+query_parse(struct query *q, char *buf, size_t bufsize)
+{
+	const char	*p = q->q_text, *val, *col;
+	int64_t		*date;
+	int		*has;
+	size_t		 len, clen;
 
+	*buf = '\0';
 	for (;;) {
-		err = sqlite3_step(env->env_query);
-		if (err == SQLITE_DONE)
-			break;
-		if (err != SQLITE_ROW) {
-			log_warnx("%s: sqlite3_step %s", __func__,
-			    sqlite3_errstr(err));
+		p += strspn(p, " \f\n\r\t\v");
+		if (*p == '\0')
 			break;
-		}
-
-		have_results = 1;
 
-		mid = sqlite3_column_text(env->env_query, 0);
-		from = sqlite3_column_text(env->env_query, 1);
-		date = sqlite3_column_int64(env->env_query, 2);
-		subj = sqlite3_column_text(env->env_query, 3);
-		snip = sqlite3_column_text(env->env_query, 4);
+		col = NULL;
+		date = NULL;
+		has = NULL;
+		if (!strncasecmp(p, "from:", 5)) {
+			col = "{from} : ";
+			p += 5;
+		} else if (!strncasecmp(p, "subject:", 8)) {
+			col = "{subj} : ";
+			p += 8;
+		} else if (!strncasecmp(p, "after:", 6)) {
+			date = &q->q_datemin;
+			has = &q->q_hasmin;
+			p += 6;
+		} else if (!strncasecmp(p, "before:", 7)) {
+			date = &q->q_datemax;
+			has = &q->q_hasmax;
+			p += 7;
+		}
 
-		if ((sizeof(d) == 4) && date > UINT32_MAX) {
-			log_warnx("overflow of 32bit time value");
-			date = 0;
+		if (*p == '"') {
+			val = ++p;
+			len = strcspn(p, "\"");
+			p += len;
+			if (*p == '"')
+				p++;
+		} else {
+			val = p;
+			len = strcspn(p, " \f\n\r\t\v");
+			p += len;
 		}
 
-		d = date;
-		if ((tm = gmtime(&d)) == NULL) {
-			log_warnx("gmtime failure");
+		if (len == 0)
 			continue;
-		}
 
-		if (strftime(dbuf, sizeof(dbuf), "%F %R", tm) == 0) {
-			log_warnx("strftime failure");
+		if (date != NULL) {
+			if (parse_date(val, len, date) == -1)
+				log_info("invalid date: %.*s", (int)len, val);
+			else
+				*has = 1;
 			continue;
 		}
 
-		if (clt_puts(clt, "<li class='mail'>"
-		    "<p class='mail-meta'><time>") == -1 ||
-		    clt_putsan(clt, dbuf) == -1 ||
-		    clt_puts(clt, "</time> <span class='from'>") == -1 ||
-		    clt_putsan(clt, from) == -1 ||
-		    clt_puts(clt, "</span><span class=colon>:</span>") == -1 ||
-		    clt_puts(clt, "</p>"
-			"<p class='subject'>"
-			"<a href='/mail/") == -1 ||
-		    clt_putsan(clt, mid) == -1 ||
-		    clt_puts(clt, ".html'>") == -1 ||
-		    clt_putsan(clt, subj) == -1 ||
-		    clt_puts(clt, "</a></p><p class=excerpt>") == -1 ||
-		    clt_putmatch(clt, snip) == -1 ||
-		    clt_puts(clt, "</p></li>") == -1)
-			goto err;
+		if (col != NULL) {
+			clen = strlen(col);
+			if (bufsize <= clen)
+				return (-1);
+			memcpy(buf, col, clen);
+			buf += clen;
+			bufsize -= clen;
+		}
+
+		if (fts_quote(&buf, &bufsize, val, len) == -1)
+			return (-1);
 	}
 
-	if (clt_puts(clt, "</ul></div>") == -1)
-		goto err;
+	if (bufsize == 0)
+		return (-1);
+	*buf = '\0';
+	return (0);
+}
 
-	if (!have_results &&
-	    clt_puts(clt, "<p class='notice'>No mail found.</p>") == -1)
-		goto err;
+/*
+ * The strings of the row are copied in the arena, which the job keeps
+ * until it's done.
+ */
+static int
+row_fill(sqlite3_stmt *stmt, struct row *row, struct arena *arena)
+{
+	const char	*t;
 
-done:
-	if (render_tmpl(clt, tmpl_foot, NULL, NULL) == -1)
-		goto err;
+	if (((t = sqlite3_column_text(stmt, 1)) != NULL &&
+	    (row->r_mid = arena_strdup(arena, t)) == NULL) ||
+	    ((t = sqlite3_column_text(stmt, 2)) != NULL &&
+	    (row->r_from = arena_strdup(arena, t)) == NULL) ||
+	    ((t = sqlite3_column_text(stmt, 3)) != NULL &&
+	    (row->r_subj = arena_strdup(arena, t)) == NULL) ||
+	    ((t = sqlite3_column_text(stmt, 4)) != NULL &&
+	    (row->r_snip = arena_strdup(arena, t)) == NULL)) {
+		log_warn("%s: arena_strdup", __func__);
+		return (-1);
+	}
+	return (0);
+}
 
-	sqlite3_reset(env->env_query);
-	return (fcgi_end_request(clt, 0));
-err:
-	sqlite3_reset(env->env_query);
-	return (-1);
+/*
+ * Fill in the columns and the excerpt of the rows of the page.  When
+ * the matches between the first and the last rowid of the page are
+ * known to be few, they are all walked in a single statement,
+ * otherwise the rows are looked up one at a time, which has a higher
+ * fixed cost.
+ */
+static int
+server_fetch_rows(struct dbconn *dbc, const char *esc, struct result *res,
+    struct arena *arena, int range)
+{
+	sqlite3_stmt	*stmt;
+	struct row	*row;
+	int64_t		 id, min, max;
+	size_t		 i, j;
+	int		 err = SQLITE_OK;
+
+	if (res->res_nrows == 0)
+		return (0);
+
+	if (range) {
+		min = max = res->res_rows[0].r_cursor.cur_rowid;
+		for (i = 1; i < res->res_nrows; ++i) {
+			id = res->res_rows[i].r_cursor.cur_rowid;
+			if (id < min)
+				min = id;
+			if (id > max)
+				max = id;
+		}
+
+		stmt = dbc->dbc_range;
+		err = sqlite3_bind_text(stmt, 1, esc, -1, NULL);
+		if (err == SQLITE_OK)
+			err = sqlite3_bind_int64(stmt, 2, min);
+		if (err == SQLITE_OK)
+			err = sqlite3_bind_int64(stmt, 3, max);
+
+		for (j = 0; err == SQLITE_OK;) {
+			if ((err = sqlite3_step(stmt)) != SQLITE_ROW)
+				break;
+			err = SQLITE_OK;
+
+			/* the rows are often in the same order */
+			id = sqlite3_column_int64(stmt, 0);
+			for (i = 0; i < res->res_nrows; ++i) {
+				row = &res->res_rows[(j + i) % res->res_nrows];
+				if (row->r_cursor.cur_rowid == id &&
+				    row->r_mid == NULL)
+					break;
+			}
+			if (i == res->res_nrows)
+				continue;
+			j = (j + i + 1) % res->res_nrows;
+
+			if (row_fill(stmt, row, arena) == -1) {
+				sqlite3_reset(stmt);
+				return (-1);
+			}
+		}
+		sqlite3_reset(stmt);
+	} else {
+		stmt = dbc->dbc_row;
+		for (i = 0; i < res->res_nrows; ++i) {
+			row = &res->res_rows[i];
+			err = sqlite3_bind_text(stmt, 1, esc, -1, NULL);
+			if (err == SQLITE_OK)
+				err = sqlite3_bind_int64(stmt, 2,
+				    row->r_cursor.cur_rowid);
+			if (err == SQLITE_OK &&
+			    (err = sqlite3_step(stmt)) == SQLITE_ROW) {
+				err = SQLITE_OK;
+				if (row_fill(stmt, row, arena) == -1) {
+					sqlite3_reset(stmt);
+					return (-1);
+				}
+			}
+			sqlite3_reset(stmt);
+			if (err != SQLITE_OK && err != SQLITE_DONE)
+				break;
+		}
+	}
+
+	if (err != SQLITE_OK && err != SQLITE_DONE)
+		log_warnx("%s: %s", __func__, sqlite3_errstr(err));
+
+	/* show only the rows before one that went missing */
+	for (i = 0; i < res->res_nrows; ++i) {
+		if (res->res_rows[i].r_mid == NULL) {
+			log_warnx("%s: row %lld not found", __func__,
+			    (long long)res->res_rows[i].r_cursor.cur_rowid);
+			res->res_nrows = i;
+			res->res_complete = 0;
+			break;
+		}
+	}
+	return (0);
+}
+
+static uint32_t
+count_hash(const char *key)
+{
+	uint32_t	 h = 2166136261U;	/* FNV-1a */
+
+	while (*key != '\0') {
+		h ^= (unsigned char)*key++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Count the matches, exactly if they're estimated to be few enough,
+ * otherwise estimate them to two significant digits.
+ */
+static void
+server_count_query(struct dbconn *dbc, struct query *q, const char *esc,
+    struct result *res)
+{
+	sqlite3_stmt	*stmt;
+	int64_t		 est, m;
+	int		 err, shape = QS_COUNT, n = 1;
+
+	est = vocab_estimate(dbc->dbc_vocab, esc,
+	    q->q_hasmin ? q->q_datemin : INT64_MIN,
+	    q->q_hasmax ? q->q_datemax : INT64_MAX);
+	if (est == -1)
+		return;
+
+	if (est >= COUNT_EXACT_MAX) {
+		for (m = 1; est / m >= 100; m *= 10)
+			/* nop */ ;
+		res->res_count = (est + m / 2) / m * m;
+		return;
+	}
+
+	if (q->q_hasmin)
+		shape |= QS_DATEMIN;
+	if (q->q_hasmax)
+		shape |= QS_DATEMAX;
+	if ((stmt = server_stmt(dbc, shape)) == NULL)
+		return;
+
+	err = sqlite3_bind_text(stmt, n++, esc, -1, NULL);
+	if (err == SQLITE_OK && q->q_hasmin)
+		err = sqlite3_bind_int64(stmt, n++, q->q_datemin);
+	if (err == SQLITE_OK && q->q_hasmax)
+		err = sqlite3_bind_int64(stmt, n++, q->q_datemax);
+
+	dbc->dbc_deadline = q->q_deadline;
+	if (err == SQLITE_OK && (err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		res->res_count = sqlite3_column_int64(stmt, 0);
+		res->res_exact = 1;
+	} else
+		res->res_count = est;
+	memset(&dbc->dbc_deadline, 0, sizeof(dbc->dbc_deadline));
+	sqlite3_reset(stmt);
+}
+
+/*
+ * Set the number of matches: exact when the page holds them all,
+ * otherwise the one of the search, counted on its first visited page.
+ */
+static void
+server_count(struct dbconn *dbc, struct query *q, const char *esc,
+    struct result *res, int all)
+{
+	struct count_ent	*ce = NULL;
+	char			 key[COUNT_KEYLEN];
+	uint32_t		 h = 0;
+	int			 r;
+
+	res->res_count = -1;
+	res->res_exact = 0;
+
+	if (all) {
+		res->res_count = res->res_nrows;
+		res->res_exact = 1;
+		return;
+	}
+
+	r = snprintf(key, sizeof(key), "%s\n%d%lld\n%d%lld", esc,
+	    q->q_hasmin, (long long)q->q_datemin,
+	    q->q_hasmax, (long long)q->q_datemax);
+	if (dbc->dbc_counts != NULL && r >= 0 && (size_t)r < sizeof(key)) {
+		h = count_hash(key);
+		ce = &dbc->dbc_counts[h % COUNT_CACHE];
+		if (ce->ce_hash == h && !strcmp(ce->ce_key, key)) {
+			res->res_count = ce->ce_count;
+			res->res_exact = ce->ce_exact;
+			return;
+		}
+	}
+
+	server_count_query(dbc, q, esc, res);
+
+	if (ce != NULL && res->res_count != -1) {
+		ce->ce_hash = h;
+		ce->ce_count = res->res_count;
+		ce->ce_exact = res->res_exact;
+		strlcpy(ce->ce_key, key, sizeof(ce->ce_key));
+	}
+}
+
+/*
+ * The strings of the rows of res are allocated in arena.
+ */
+int
+server_fetch(struct dbconn *dbc, struct query *q, const char *esc,
+    struct result *res, struct arena *arena)
+{
+	sqlite3_stmt	*stmt;
+	struct row	*row, tmp;
+	uint64_t	 start;
+	size_t		 i, j;
+	int		 err, shape = 0, n = 1, more = 0, all, range;
+
+	if (dbc->dbc_stale)
+		server_refresh_db(dbc);
+
+	memset(res, 0, sizeof(*res));
+	res->res_complete = 1;
+	start = stats_now();
+
+	if (q->q_dir == PAGE_AFTER)
+		shape |= QS_AFTER;
+	else if (q->q_dir == PAGE_BEFORE)
+		shape |= QS_BEFORE;
+	if (q->q_hasmin)
+		shape |= QS_DATEMIN;
+	if (q->q_hasmax)
+		shape |= QS_DATEMAX;
+	if (q->q_sort == SORT_DATE)
+		shape |= QS_BYDATE;
+
+	if ((stmt = server_stmt(dbc, shape)) == NULL)
+		return (-1);
+
+	err = sqlite3_bind_text(stmt, n++, esc, -1, NULL);
+	if (err == SQLITE_OK && q->q_hasmin)
+		err = sqlite3_bind_int64(stmt, n++, q->q_datemin);
+	if (err == SQLITE_OK && q->q_hasmax)
+		err = sqlite3_bind_int64(stmt, n++, q->q_datemax);
+	if (err == SQLITE_OK && q->q_dir != PAGE_FIRST &&
+	    q->q_sort == SORT_DATE)
+		err = sqlite3_bind_int64(stmt, n++, q->q_cursor.cur_rowid);
+	else if (err == SQLITE_OK && q->q_dir != PAGE_FIRST) {
+		err = sqlite3_bind_double(stmt, n++, q->q_cursor.cur_rank);
+		if (err == SQLITE_OK)
+			err = sqlite3_bind_int64(stmt, n++,
+			    q->q_cursor.cur_date);
+		if (err == SQLITE_OK)
+			err = sqlite3_bind_int64(stmt, n++,
+			    q->q_cursor.cur_rowid);
+	}
+	if (err == SQLITE_OK)
+		err = sqlite3_bind_int(stmt, n++, RESULTS_PER_PAGE + 1);
+	if (err != SQLITE_OK) {
+		log_warnx("%s: sqlite3_bind %s", __func__,
+		    sqlite3_errstr(err));
+		sqlite3_reset(stmt);
+		return (-1);
+	}
+
+	dbc->dbc_deadline = q->q_deadline;
+	for (;;) {
+		err = sqlite3_step(stmt);
+		if (err == SQLITE_DONE)
+			break;
+		if (err == SQLITE_INTERRUPT) {
+			/* keep what was found so far */
+			res->res_complete = 0;
+			res->res_truncated = 1;
+			break;
+		}
+		if (err != SQLITE_ROW) {
+			log_warnx("%s: sqlite3_step %s", __func__,
+			    sqlite3_errstr(err));
+			res->res_complete = 0;
+			break;
+		}
+
+		if (res->res_nrows == RESULTS_PER_PAGE) {
+			more = 1;
+			break;
+		}
+
+		row = &res->res_rows[res->res_nrows++];
+		row->r_cursor.cur_rowid = sqlite3_column_int64(stmt, 0);
+		row->r_cursor.cur_rank = sqlite3_column_double(stmt, 1);
+		row->r_cursor.cur_date = sqlite3_column_int64(stmt, 2);
+	}
+	sqlite3_reset(stmt);
+
+	/* a page is a bounded amount of work: no need for a deadline */
+	memset(&dbc->dbc_deadline, 0, sizeof(dbc->dbc_deadline));
+
+	if (q->q_dir == PAGE_BEFORE) {
+		/* rows were fetched backward */
+		for (i = 0, j = res->res_nrows; i < j / 2; ++i) {
+			tmp = res->res_rows[i];
+			res->res_rows[i] = res->res_rows[j - i - 1];
+			res->res_rows[j - i - 1] = tmp;
+		}
+		res->res_prev = more;
+		res->res_next = 1;
+	} else {
+		res->res_prev = q->q_dir == PAGE_AFTER;
+		res->res_next = more;
+	}
+
+	/*
+	 * When sorting by date the page is a run of consecutive
+	 * matches, as it is when it holds all of them.
+	 */
+	all = q->q_dir == PAGE_FIRST && !more && !res->res_truncated;
+	range = q->q_sort == SORT_DATE || all;
+	if (server_fetch_rows(dbc, esc, res, arena, range) == -1)
+		return (-1);
+
+	server_count(dbc, q, esc, res, all);
+	res->res_usec = stats_now() - start;
+
+	/* allow to continue after the last row found */
+	if (res->res_truncated && res->res_nrows > 0)
+		res->res_next = 1;
+
+	return (0);
+}
+
+static int
+server_cachekey(struct query *q, const char *esc, char *buf, size_t bufsize)
+{
+	char		 cursor[CURSOR_MAXLEN];
+	size_t		 len;
+	int		 r;
+
+	if (cache_key(esc, buf, bufsize) == -1)
+		return (-1);
+
+	if (q->q_sort == SORT_DATE &&
+	    strlcat(buf, "\nsdate", bufsize) >= bufsize)
+		return (-1);
+
+	if (q->q_format == FORMAT_JSON &&
+	    strlcat(buf, "\njson", bufsize) >= bufsize)
+		return (-1);
+
+	if (q->q_hasmin) {
+		len = strlen(buf);
+		r = snprintf(buf + len, bufsize - len, "\nd>%lld",
+		    (long long)q->q_datemin);
+		if (r < 0 || (size_t)r >= bufsize - len)
+			return (-1);
+	}
+
+	if (q->q_hasmax) {
+		len = strlen(buf);
+		r = snprintf(buf + len, bufsize - len, "\nd<%lld",
+		    (long long)q->q_datemax);
+		if (r < 0 || (size_t)r >= bufsize - len)
+			return (-1);
+	}
+
+	if (q->q_dir == PAGE_FIRST)
+		return (0);
+
+	if (cursor_fmt(&q->q_cursor, cursor, sizeof(cursor)) == -1)
+		return (-1);
+
+	len = strlen(buf);
+	r = snprintf(buf + len, bufsize - len, "\n%c%s",
+	    q->q_dir == PAGE_AFTER ? 'a' : 'b', cursor);
+	if (r < 0 || (size_t)r >= bufsize - len)
+		return (-1);
+	return (0);
+}
+
+static int
+server_cacheget(struct env *env, const char *key, struct evbuffer *buf,
+    const char **data, size_t *len)
+{
+	uint64_t	 gen;
+
+	if (cache_get(&env->env_cache, key, data, len) == 0) {
+		log_debug("cache hit for %s", key);
+		stats_count(ST_CACHE_HITS);
+		return (0);
+	}
+
+	if (shcache_get(&env->env_shcache, key, buf, &gen) == 0) {
+		log_debug("shared cache hit for %s", key);
+		*data = EVBUFFER_DATA(buf);
+		*len = EVBUFFER_LENGTH(buf);
+		/* the local cache may have been flushed since */
+		if (gen == env->env_shcache.sc_gen)
+			cache_put(&env->env_cache, key, *data, *len);
+		stats_count(ST_CACHE_HITS);
+		return (0);
+	}
+
+	stats_count(ST_CACHE_MISSES);
+	return (-1);
+}
+
+static int
+server_urlencode(struct client *clt, const char *s)
+{
+	int	 r;
+
+	for (; *s; ++s) {
+		if (isalnum((unsigned char)*s) || strchr("-._~", *s))
+			r = clt_putc(clt, *s);
+		else if (*s == ' ')
+			r = clt_putc(clt, '+');
+		else
+			r = clt_printf(clt, "%%%02X", (unsigned char)*s);
+		if (r == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static int
+render_pagelink(struct client *clt, struct query *q, const char *dir,
+    const struct cursor *cur, int page, const char *label)
+{
+	char		 cursor[CURSOR_MAXLEN];
+
+	if (cursor_fmt(cur, cursor, sizeof(cursor)) == -1)
+		return (-1);
+
+	if (clt_puts(clt, "<a href='?q=") == -1 ||
+	    server_urlencode(clt, q->q_text) == -1 ||
+	    (q->q_sort == SORT_DATE && clt_puts(clt, "&amp;sort=date") == -1) ||
+	    clt_printf(clt, "&amp;%s=%s&amp;page=%d'>%s</a>", dir, cursor,
+	    page, label) == -1)
+		return (-1);
+	return (0);
+}
+
+static int
+render_sort(struct client *clt, struct query *q)
+{
+	if (clt_puts(clt, "<nav>") == -1)
+		return (-1);
+
+	if (q->q_sort == SORT_DATE) {
+		if (clt_puts(clt, "<a href='?q=") == -1 ||
+		    server_urlencode(clt, q->q_text) == -1 ||
+		    clt_puts(clt, "'>Most relevant</a>"
+		    "<span>Newest first</span>") == -1)
+			return (-1);
+	} else {
+		if (clt_puts(clt, "<span>Most relevant</span>") == -1 ||
+		    clt_puts(clt, "<a href='?q=") == -1 ||
+		    server_urlencode(clt, q->q_text) == -1 ||
+		    clt_puts(clt, "&amp;sort=date'>Newest first</a>") == -1)
+			return (-1);
+	}
+
+	return (clt_puts(clt, "</nav>"));
+}
+
+static int
+render_nav(struct client *clt, struct query *q, struct pagenav *nav)
+{
+	if (!nav->pn_prev && !nav->pn_next)
+		return (0);
+
+	if (clt_puts(clt, "<nav>") == -1)
+		return (-1);
+
+	if (nav->pn_prev && render_pagelink(clt, q, "before",
+	    &nav->pn_first, q->q_page > 1 ? q->q_page - 1 : 1,
+	    "Prev") == -1)
+		return (-1);
+
+	if (clt_printf(clt, "<span>Page %d</span>", q->q_page) == -1)
+		return (-1);
+
+	if (nav->pn_next && render_pagelink(clt, q, "after",
+	    &nav->pn_last, q->q_page + 1, "Next") == -1)
+		return (-1);
+
+	return (clt_puts(clt, "</nav>"));
+}
+
+static int
+render_row(struct client *clt, struct row *row)
+{
+	const char	*vals[TV__MAX] = { NULL };
+	char		 dbuf[64];
+	uint64_t	 date;
+	time_t		 d;
+	struct tm	*tm;
+
+	date = row->r_cursor.cur_date;
+	if ((sizeof(d) == 4) && date > UINT32_MAX) {
+		log_warnx("overflow of 32bit time value");
+		date = 0;
+	}
+
+	d = date;
+	if ((tm = gmtime(&d)) == NULL) {
+		log_warnx("gmtime failure");
+		return (0);
+	}
+
+	if (strftime(dbuf, sizeof(dbuf), "%F %R", tm) == 0) {
+		log_warnx("strftime failure");
+		return (0);
+	}
+
+	vals[TV_DATE] = dbuf;
+	vals[TV_FROM] = row->r_from;
+	vals[TV_MID] = row->r_mid;
+	vals[TV_SUBJECT] = row->r_subj;
+	vals[TV_EXCERPT] = row->r_snip;
+	return (tmpl_render(clt, tmpl_search_result, vals));
+}
+
+static void
+result_nav(struct result *res, struct pagenav *nav)
+{
+	memset(nav, 0, sizeof(*nav));
+	nav->pn_prev = res->res_prev;
+	nav->pn_next = res->res_next;
+	if (res->res_nrows > 0) {
+		nav->pn_first = res->res_rows[0].r_cursor;
+		nav->pn_last = res->res_rows[res->res_nrows - 1].r_cursor;
+	}
+}
+
+static int
+render_result_head(struct client *clt, struct result *res)
+{
+	if (res->res_nrows > 0 && res->res_count >= 0 &&
+	    clt_printf(clt, "<p class='notice'>%s%lld result%s</p>",
+	    res->res_exact ? "" : "About ", (long long)res->res_count,
+	    res->res_count == 1 ? "" : "s") == -1)
+		return (-1);
+
+	return (clt_puts(clt, "<div class='thread'><ul>"));
+}
+
+static int
+render_result_foot(struct client *clt, struct result *res)
+{
+	if (clt_puts(clt, "</ul></div>") == -1)
+		return (-1);
+
+	if (res->res_truncated) {
+		if (clt_puts(clt, "<p class='notice'>Results truncated:"
+		    " the search took too long.</p>") == -1)
+			return (-1);
+	} else if (res->res_nrows == 0 &&
+	    clt_puts(clt, "<p class='notice'>No mail found.</p>") == -1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * The JSON reply has the same parts as the page: the query, then the
+ * count and the results, which are cached, and the cursors of the
+ * pages around.  The excerpts come without markup, with the offsets
+ * and lengths of the matches in bytes.
+ */
+static int
+json_head(struct client *clt, struct query *q)
+{
+	if (server_reply(clt, 200, "application/json") == -1 ||
+	    clt_puts(clt, "{\"query\":") == -1 ||
+	    clt_putjson(clt, q->q_text) == -1)
+		return (-1);
+	return (clt_printf(clt, ",\"sort\":\"%s\",\"page\":%d",
+	    q->q_sort == SORT_DATE ? "date" : "rank", q->q_page));
+}
+
+static int
+json_result_head(struct client *clt, struct result *res)
+{
+	if (res->res_count >= 0 &&
+	    clt_printf(clt, ",\"count\":%lld", (long long)res->res_count) == -1)
+		return (-1);
+	if (res->res_count < 0 && clt_puts(clt, ",\"count\":null") == -1)
+		return (-1);
+	return (clt_printf(clt, ",\"exact\":%s,\"results\":[",
+	    res->res_exact ? "true" : "false"));
+}
+
+static int
+json_row(struct client *clt, struct row *row, int first)
+{
+	struct span	 m[MATCHES_MAX];
+	size_t		 i, n = MATCHES_MAX;
+
+	if (clt_puts(clt, first ? "{\"mid\":" : ",{\"mid\":") == -1 ||
+	    clt_putjson(clt, row->r_mid) == -1 ||
+	    clt_puts(clt, ",\"from\":") == -1 ||
+	    clt_putjson(clt, row->r_from) == -1 ||
+	    clt_printf(clt, ",\"date\":%lld,\"subject\":",
+	    (long long)row->r_cursor.cur_date) == -1 ||
+	    clt_putjson(clt, row->r_subj) == -1 ||
+	    clt_puts(clt, ",\"snippet\":") == -1 ||
+	    clt_putjsonmatch(clt, row->r_snip, m, &n) == -1 ||
+	    clt_puts(clt, ",\"matches\":[") == -1)
+		return (-1);
+
+	for (i = 0; i < n; ++i)
+		if (clt_printf(clt, "%s[%zu,%zu]", i == 0 ? "" : ",",
+		    m[i].sp_off, m[i].sp_len) == -1)
+			return (-1);
+
+	return (clt_puts(clt, "]}"));
+}
+
+static int
+json_result_foot(struct client *clt, struct result *res)
+{
+	return (clt_printf(clt, "],\"truncated\":%s",
+	    res->res_truncated ? "true" : "false"));
+}
+
+static int
+json_pagelink(struct client *clt, const char *dir, int set,
+    const struct cursor *cur, int page)
+{
+	char		 cursor[CURSOR_MAXLEN];
+
+	if (!set)
+		return (clt_puts(clt, "null"));
+
+	if (cursor_fmt(cur, cursor, sizeof(cursor)) == -1)
+		return (-1);
+	return (clt_printf(clt, "{\"%s\":\"%s\",\"page\":%d}", dir, cursor,
+	    page));
+}
+
+static int
+json_nav(struct client *clt, struct query *q, struct pagenav *nav)
+{
+	if (clt_puts(clt, ",\"prev\":") == -1 ||
+	    json_pagelink(clt, "before", nav->pn_prev, &nav->pn_first,
+	    q->q_page > 1 ? q->q_page - 1 : 1) == -1 ||
+	    clt_puts(clt, ",\"next\":") == -1 ||
+	    json_pagelink(clt, "after", nav->pn_next, &nav->pn_last,
+	    q->q_page + 1) == -1)
+		return (-1);
+	return (0);
+}
+
+static int
+server_error(struct client *clt)
+{
+	stats_count(ST_ERRORS);
+	if (server_reply(clt, 500, "text/plain") == -1 ||
+	    clt_puts(clt, "Internal server error\n") == -1)
+		return (-1);
+	return (fcgi_end_request(clt, 1));
+}
+
+/*
+ * The navigation links, if there's a query, and the end of the page.
+ */
+static int
+render_foot(struct client *clt, struct query *q, struct pagenav *nav)
+{
+	if (q->q_format == FORMAT_JSON) {
+		if (json_nav(clt, q, nav) == -1)
+			return (-1);
+		return (clt_puts(clt, "}\n"));
+	}
+
+	if (render_nav(clt, q, nav) == -1)
+		return (-1);
+	return (tmpl_render(clt, tmpl_foot, NULL));
+}
+
+/*
+ * Render the rows of the job from where it was left and the rest of
+ * the page.  If the connection has too much output pending already,
+ * stop and let server_resume carry on once it's written.  The job is
+ * kept in the client in the meantime, and freed when done.
+ */
+static int
+render_rows(struct env *env, struct client *clt, struct job *job)
+{
+	struct result	*res = &job->j_res;
+	struct query	*q = &job->j_query;
+	struct row	*row;
+	struct pagenav	 nav;
+	struct evbuffer	*cap;
+	uint64_t	 start;
+	int		 r;
+
+	start = stats_now();
+	for (; job->j_row < res->res_nrows; job->j_row++) {
+		if (clt_congested(clt)) {
+			job->j_trender += stats_now() - start;
+			return (clt_pause(clt));
+		}
+		row = &res->res_rows[job->j_row];
+		if (q->q_format == FORMAT_JSON)
+			r = json_row(clt, row, job->j_row == 0);
+		else
+			r = render_row(clt, row);
+		if (r == -1)
+			return (-1);
+	}
+
+	if (q->q_format == FORMAT_JSON)
+		r = json_result_foot(clt, res);
+	else
+		r = render_result_foot(clt, res);
+	if (r == -1)
+		return (-1);
+
+	result_nav(res, &nav);
+	if ((cap = clt->clt_capture) != NULL) {
+		/*
+		 * Don't save the result if the database was reloaded
+		 * while the query ran or the page was paused.
+		 */
+		clt->clt_capture = NULL;
+		if (job->j_gen == env->env_cache.c_gen)
+			cache_put(&env->env_cache, job->j_key,
+			    EVBUFFER_DATA(cap), EVBUFFER_LENGTH(cap));
+		if (job->j_shgen == env->env_shcache.sc_gen)
+			shcache_put(&env->env_shcache, job->j_key,
+			    EVBUFFER_DATA(cap), EVBUFFER_LENGTH(cap));
+		evbuffer_free(cap);
+	}
+
+	if (render_foot(clt, q, &nav) == -1)
+		return (-1);
+
+	stats_observe(SH_RENDER, job->j_trender + stats_now() - start);
+	clt->clt_render = NULL;
+	r = fcgi_end_request(clt, 0);
+	server_job_free(job);
+	return (r);
+}
+
+/*
+ * Render the page.  data is the cached reply for the query, otherwise
+ * it's rendered from the result of the job and saved in the cache.
+ * Both are NULL when there's no query.
+ */
+static int
+server_render(struct env *env, struct client *clt, struct query *q,
+    const char *data, size_t len, struct job *job)
+{
+	const char	*vals[TV__MAX] = { NULL };
+	struct result	*res;
+	struct pagenav	 nav;
+	struct evbuffer	*cap;
+	uint64_t	 start;
+	int		 r;
+
+	start = stats_now();
+	memset(&nav, 0, sizeof(nav));
+	if (data != NULL) {
+		memcpy(&nav, data, sizeof(nav));
+		data += sizeof(nav);
+		len -= sizeof(nav);
+	} else if (job != NULL) {
+		clt->clt_render = job;
+		stats_observe(SH_QUERY, job->j_res.res_usec);
+	}
+
+	if (q->q_format == FORMAT_JSON) {
+		if (json_head(clt, q) == -1)
+			return (-1);
+		if (data == NULL && job == NULL &&
+		    clt_puts(clt, ",\"count\":0,\"exact\":true,"
+		    "\"results\":[],\"truncated\":false") == -1)
+			return (-1);
+	} else {
+		if (server_reply(clt, 200, "text/html") == -1)
+			return (-1);
+
+		vals[TV_TITLE] = "Search";
+		vals[TV_QUERY] = q->q_text;
+		if (tmpl_render(clt, tmpl_head, vals) == -1 ||
+		    tmpl_render(clt, tmpl_search_header, NULL) == -1 ||
+		    tmpl_render(clt, tmpl_search, vals) == -1)
+			return (-1);
+
+		if (data == NULL && job == NULL)
+			goto foot;
+
+		if (render_sort(clt, q) == -1)
+			return (-1);
+	}
+
+	if (job != NULL) {
+		res = &job->j_res;
+		if (*job->j_key != '\0' && res->res_complete &&
+		    (env->env_cache.c_max != 0 ||
+		    env->env_shcache.sc_hdr != NULL) &&
+		    (cap = evbuffer_new()) != NULL) {
+			result_nav(res, &nav);
+			if (evbuffer_add(cap, &nav, sizeof(nav)) == -1)
+				evbuffer_free(cap);
+			else
+				clt->clt_capture = cap;
+		}
+
+		if (res->res_truncated) {
+			env->env_truncated++;
+			stats_count(ST_TRUNCATED);
+			log_info("search for %s truncated after %zu rows",
+			    q->q_text, res->res_nrows);
+		}
+
+		if (q->q_format == FORMAT_JSON)
+			r = json_result_head(clt, res);
+		else
+			r = render_result_head(clt, res);
+		if (r == -1)
+			return (-1);
+
+		job->j_row = 0;
+		job->j_trender = stats_now() - start;
+		return (render_rows(env, clt, job));
+	}
+
+	if (data != NULL && clt_write(clt, data, len) == -1)
+		return (-1);
+
+foot:
+	if (render_foot(clt, q, &nav) == -1)
+		return (-1);
+
+	stats_observe(SH_RENDER, stats_now() - start);
+	return (fcgi_end_request(clt, 0));
+}
+
+static int
+server_stats(struct client *clt)
+{
+	if (server_reply(clt, 200, "text/plain; version=0.0.4") == -1 ||
+	    stats_render(clt) == -1)
+		return (-1);
+	return (fcgi_end_request(clt, 0));
+}
+
+/*
+ * Read the whole full text index with -W, and run the searches read
+ * from the -Q file, one per line, so that the pages they need are in
+ * memory before the first request.
+ */
+void
+server_warmup(void)
+{
+	struct dbconn	 dbc;
+	struct query	 q;
+	struct result	 res;
+	struct arena	 arena;
+	sqlite3_stmt	*stmt;
+	char		 esc[QUERY_MAXLEN];
+	char		*line, *s = warmup_searches;
+	uint64_t	 start;
+	int		 n = 0;
+
+	if (!warmup && warmup_searches == NULL)
+		return;
+
+	start = stats_now();
+	if (server_open_db(&dbc, 0) == -1)
+		return;
+
+	/* substr() so that the overflow pages are read too */
+	if (warmup && sqlite3_prepare_v2(dbc.dbc_db, "select"
+	    " sum(length(substr(block, 1))) from email_data", -1, &stmt,
+	    NULL) == SQLITE_OK) {
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+
+	arena_init(&arena, JOB_ARENA_CHUNK);
+	while ((line = strsep(&s, "\n")) != NULL) {
+		memset(&q, 0, sizeof(q));
+		q.q_text = line;
+		if (query_parse(&q, esc, sizeof(esc)) == -1 || *esc == '\0')
+			continue;
+		if (server_fetch(&dbc, &q, esc, &res, &arena) != -1)
+			n++;
+		arena_reset(&arena);
+	}
+	arena_free(&arena);
+
+	server_close_db(&dbc);
+	free(warmup_searches);
+	warmup_searches = NULL;
+
+	log_info("warmed up in %llu ms, %d searches",
+	    (unsigned long long)(stats_now() - start) / 1000, n);
+}
+
+static struct job *
+server_job_new(void)
+{
+	struct job	*job;
+	struct arena	 arena;
+
+	if ((job = TAILQ_FIRST(&job_free_list)) != NULL) {
+		TAILQ_REMOVE(&job_free_list, job, j_entry);
+		job_nfree--;
+		arena = job->j_arena;
+		memset(job, 0, sizeof(*job));
+		job->j_arena = arena;
+		return (job);
+	}
+
+	if ((job = calloc(1, sizeof(*job))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	arena_init(&job->j_arena, JOB_ARENA_CHUNK);
+	return (job);
+}
+
+int
+server_handle(struct env *env, struct client *clt)
+{
+	char		 esc[QUERY_MAXLEN];
+	char		 key[CACHEKEY_MAXLEN];
+	struct query	 q;
+	struct job	*job;
+	struct evbuffer	*hit = env->env_hit;
+	const char	*data = NULL;
+	uint64_t	 start;
+	size_t		 len = 0;
+	int		 r;
+
+	stats_count(ST_REQUESTS);
+	start = stats_now();
+
+	if (expose_stats && clt->clt_path_info != NULL &&
+	    !strcmp(clt->clt_path_info, "/stats"))
+		return (server_stats(clt));
+
+	server_getquery(clt, &q);
+	if (q.q_text == NULL ||
+	    query_parse(&q, esc, sizeof(esc)) == -1 ||
+	    *esc == '\0') {
+		stats_observe(SH_PARSE,
+		    clt->clt_tparse + stats_now() - start);
+		q.q_text = NULL;
+		return (server_render(env, clt, &q, NULL, 0, NULL));
+	}
+
+	log_debug("searching for %s", esc);
+
+	if (query_timeout != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &q.q_deadline);
+		q.q_deadline.tv_sec += query_timeout / 1000;
+		q.q_deadline.tv_nsec += (query_timeout % 1000) * 1000000;
+		if (q.q_deadline.tv_nsec >= 1000000000) {
+			q.q_deadline.tv_sec++;
+			q.q_deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	if (server_cachekey(&q, esc, key, sizeof(key)) == -1)
+		*key = '\0';
+	stats_observe(SH_PARSE, clt->clt_tparse + stats_now() - start);
+
+	if (*key != '\0' &&
+	    server_cacheget(env, key, hit, &data, &len) != -1 &&
+	    len >= sizeof(struct pagenav)) {
+		r = server_render(env, clt, &q, data, len, NULL);
+		evbuffer_drain(hit, EVBUFFER_LENGTH(hit));
+		return (r);
+	}
+	evbuffer_drain(hit, EVBUFFER_LENGTH(hit));
+
+	if ((job = server_job_new()) == NULL)
+		return (server_error(clt));
+	job->j_clt = clt;
+	job->j_query = q;
+	strlcpy(job->j_esc, esc, sizeof(job->j_esc));
+	strlcpy(job->j_key, key, sizeof(job->j_key));
+	job->j_gen = env->env_cache.c_gen;
+	job->j_shgen = env->env_shcache.sc_gen;
+
+	if (workers != 0) {
+		clt->clt_job = job;
+		return (pool_submit(job));
+	}
+
+	job->j_err = server_fetch(&env->env_dbc, &job->j_query, job->j_esc,
+	    &job->j_res, &job->j_arena);
+	return (server_job_done(env, job));
+}
+
+/*
+ * Carry on with the page paused by render_rows.
+ */
+int
+server_resume(struct client *clt)
+{
+	struct job	*job = clt->clt_render;
+
+	if (job == NULL || clt->clt_done)
+		return (0);
+	return (render_rows(clt->clt_fcgi->fcg_env, clt, job));
+}
+
+/*
+ * Called in the main thread when the query of a client still waiting
+ * for it is done.  The job is then owned by the rendering.
+ */
+int
+server_job_done(struct env *env, struct job *job)
+{
+	struct client	*clt = job->j_clt;
+
+	if (job->j_err == -1) {
+		server_job_free(job);
+		return (server_error(clt));
+	}
+	return (server_render(env, clt, &job->j_query, NULL, 0, job));
+}
+
+/*
+ * The strings of the results go away with the arena; the job, with the
+ * first chunk of the arena, is kept for the next search.
+ */
+void
+server_job_free(struct job *job)
+{
+	arena_reset(&job->j_arena);
+	if (job_nfree < JOB_FREE_MAX) {
+		TAILQ_INSERT_HEAD(&job_free_list, job, j_entry);
+		job_nfree++;
+		return;
+	}
+
+	arena_free(&job->j_arena);
+	free(job);
 }
 
 void
 server_client_free(struct client *clt)
 {
-	free(clt->clt_server_name);
-	free(clt->clt_script_name);
-	free(clt->clt_path_info);
-	free(clt->clt_query);
-	free(clt);
+	if (clt->clt_job != NULL)
+		pool_cancel(clt->clt_job);
+	if (clt->clt_render != NULL)
+		server_job_free(clt->clt_render);
+	clt_free(clt);
 }
@@ -0,0 +1,281 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+/*
+ * Each child has a slot in a memory segment created by the parent,
+ * and is the only one writing to it.  Whatever child gets the
+ * request for the stats page sums all the slots, so the numbers are
+ * those of the whole server.  The parent maps the segment too, to
+ * know how loaded the children are.
+ */
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ADD(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+#define HIST_NBUCKETS	16	/* including +Inf */
+
+struct histogram {
+	uint64_t	h_buckets[HIST_NBUCKETS];
+	uint64_t	h_sum;
+	uint64_t	h_count;
+};
+
+struct stats {
+	uint64_t	 st_counters[ST__MAX];
+	int64_t		 st_inflight;
+	int64_t		 st_busy;
+	struct histogram st_hist[SH__MAX];
+};
+
+static const uint64_t time_bounds[] = {	/* microseconds */
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 0
+};
+
+static const uint64_t size_bounds[] = {	/* bytes */
+	256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 0
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+} counters[ST__MAX] = {
+	[ST_REQUESTS] =		{ "requests", "Requests received." },
+	[ST_ERRORS] =		{ "errors", "Requests failed with an error." },
+	[ST_ABORTS] =		{ "aborts", "Requests aborted." },
+	[ST_TRUNCATED] =	{ "truncated", "Searches out of time." },
+	[ST_CACHE_HITS] =	{ "cache_hits", "Searches found in cache." },
+	[ST_CACHE_MISSES] =	{ "cache_misses", "Searches not in cache." },
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+	const uint64_t	*bounds;
+	double		 scale;
+} hists[SH__MAX] = {
+	[SH_PARSE] =	{ "parse_seconds", "Time spent parsing requests.",
+			  time_bounds, 1e6 },
+	[SH_QUERY] =	{ "query_seconds", "Time spent querying the db.",
+			  time_bounds, 1e6 },
+	[SH_RENDER] =	{ "render_seconds", "Time spent rendering pages.",
+			  time_bounds, 1e6 },
+	[SH_BYTES] =	{ "response_bytes", "Size of the replies.",
+			  size_bounds, 1 },
+};
+
+static struct stats	*stats_slots;
+static struct stats	*stats_self;
+
+size_t
+stats_size(void)
+{
+	return (MAX_CHILDREN * sizeof(struct stats));
+}
+
+int
+stats_attach(int fd, int slot)
+{
+	struct stat	 sb;
+	void		*seg;
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("%s: fstat", __func__);
+		return (-1);
+	}
+
+	if ((size_t)sb.st_size != stats_size() ||
+	    slot < -1 || slot >= MAX_CHILDREN) {
+		log_warnx("%s: bad stats segment", __func__);
+		return (-1);
+	}
+
+	seg = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		return (-1);
+	}
+
+	/* a child forked with -f already has the parent's mapping */
+	if (stats_slots != NULL)
+		munmap(stats_slots, stats_size());
+	stats_slots = seg;
+	if (slot != -1)
+		stats_self = &stats_slots[slot];
+	return (0);
+}
+
+/*
+ * Number of requests being processed by the child in the given slot.
+ */
+int64_t
+stats_load(int slot)
+{
+	return (LOAD(&stats_slots[slot].st_busy));
+}
+
+/*
+ * The child in the given slot is gone, and so are its connections.
+ * The counters are kept, to be continued by the next one.
+ */
+void
+stats_release(int slot)
+{
+	STORE(&stats_slots[slot].st_inflight, 0);
+	STORE(&stats_slots[slot].st_busy, 0);
+}
+
+/*
+ * Monotonic time in microseconds.
+ */
+uint64_t
+stats_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void
+stats_count(int c)
+{
+	if (stats_self != NULL)
+		ADD(&stats_self->st_counters[c], 1);
+}
+
+void
+stats_inflight(int n)
+{
+	if (stats_self != NULL)
+		STORE(&stats_self->st_inflight, n);
+}
+
+void
+stats_busy(int n)
+{
+	if (stats_self != NULL)
+		STORE(&stats_self->st_busy, n);
+}
+
+void
+stats_observe(int h, uint64_t v)
+{
+	struct histogram	*hist;
+	const uint64_t		*b;
+	size_t			 i;
+
+	if (stats_self == NULL)
+		return;
+
+	b = hists[h].bounds;
+	for (i = 0; b[i] != 0 && v > b[i]; ++i)
+		/* nop */ ;
+
+	hist = &stats_self->st_hist[h];
+	ADD(&hist->h_buckets[i], 1);
+	ADD(&hist->h_sum, v);
+	ADD(&hist->h_count, 1);
+}
+
+static int
+stats_header(struct client *clt, const char *name, const char *help,
+    const char *type)
+{
+	return (clt_printf(clt, "# HELP msearchd_%s %s\n"
+	    "# TYPE msearchd_%s %s\n", name, help, name, type));
+}
+
+/*
+ * Write the stats of all the children in the Prometheus text format.
+ */
+int
+stats_render(struct client *clt)
+{
+	struct histogram	 hist, *h;
+	const uint64_t		*b;
+	uint64_t		 n, cum;
+	int64_t			 inflight = 0, busy = 0;
+	double			 scale;
+	size_t			 i, j, k;
+
+	if (stats_slots == NULL)
+		return (clt_puts(clt, "# stats are not available\n"));
+
+	for (i = 0; i < ST__MAX; ++i) {
+		for (n = 0, j = 0; j < MAX_CHILDREN; ++j)
+			n += LOAD(&stats_slots[j].st_counters[i]);
+		if (clt_printf(clt, "# HELP msearchd_%s_total %s\n"
+		    "# TYPE msearchd_%s_total counter\n"
+		    "msearchd_%s_total %llu\n", counters[i].name,
+		    counters[i].help, counters[i].name, counters[i].name,
+		    (unsigned long long)n) == -1)
+			return (-1);
+	}
+
+	for (j = 0; j < MAX_CHILDREN; ++j) {
+		inflight += LOAD(&stats_slots[j].st_inflight);
+		busy += LOAD(&stats_slots[j].st_busy);
+	}
+	if (stats_header(clt, "inflight", "Open FastCGI connections.",
+	    "gauge") == -1 ||
+	    clt_printf(clt, "msearchd_inflight %lld\n",
+	    (long long)inflight) == -1 ||
+	    stats_header(clt, "busy", "Requests being processed.",
+	    "gauge") == -1 ||
+	    clt_printf(clt, "msearchd_busy %lld\n", (long long)busy) == -1)
+		return (-1);
+
+	for (i = 0; i < SH__MAX; ++i) {
+		memset(&hist, 0, sizeof(hist));
+		for (j = 0; j < MAX_CHILDREN; ++j) {
+			h = &stats_slots[j].st_hist[i];
+			for (k = 0; k < HIST_NBUCKETS; ++k)
+				hist.h_buckets[k] += LOAD(&h->h_buckets[k]);
+			hist.h_sum += LOAD(&h->h_sum);
+			hist.h_count += LOAD(&h->h_count);
+		}
+
+		if (stats_header(clt, hists[i].name, hists[i].help,
+		    "histogram") == -1)
+			return (-1);
+
+		b = hists[i].bounds;
+		scale = hists[i].scale;
+		for (cum = 0, k = 0; b[k] != 0; ++k) {
+			cum += hist.h_buckets[k];
+			if (clt_printf(clt,
+			    "msearchd_%s_bucket{le=\"%.15g\"} %llu\n",
+			    hists[i].name, b[k] / scale,
+			    (unsigned long long)cum) == -1)
+				return (-1);
+		}
+		cum += hist.h_buckets[k];
+
+		if (clt_printf(clt, "msearchd_%s_bucket{le=\"+Inf\"} %llu\n"
+		    "msearchd_%s_sum %.15g\n"
+		    "msearchd_%s_count %llu\n",
+		    hists[i].name, (unsigned long long)cum,
+		    hists[i].name, hist.h_sum / scale,
+		    hists[i].name, (unsigned long long)hist.h_count) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
@@ -0,0 +1,20 @@
+/* public domain */
+
+#include <pthread.h>
+#include <stddef.h>
+
+static void *
+run(void *arg)
+{
+	return (arg);
+}
+
+int
+main(void)
+{
+	pthread_t	th;
+
+	if (pthread_create(&th, NULL, run, NULL) != 0)
+		return (1);
+	return (pthread_join(th, NULL));
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+/*
+ * Templates are split once at startup in a sequence of literal
+ * chunks and variables, so that rendering them doesn't need to scan
+ * the text again.
+ */
+
+struct tmpl_seg {
+	const char	*ts_str;
+	size_t		 ts_len;
+	int		 ts_var;	/* -1 for literal text */
+};
+
+struct template {
+	char		*tp_buf;
+	struct tmpl_seg	*tp_segs;
+	size_t		 tp_nsegs;
+};
+
+static const struct {
+	const char	*name;
+	int		(*put)(struct client *, const char *);
+} tmpl_vars[TV__MAX] = {
+	[TV_TITLE] =	{ "TITLE",	clt_putsan },
+	[TV_QUERY] =	{ "QUERY",	clt_putsan },
+	[TV_DATE] =	{ "DATE",	clt_putsan },
+	[TV_FROM] =	{ "FROM",	clt_putsan },
+	[TV_MID] =	{ "MID",	clt_putsan },
+	[TV_SUBJECT] =	{ "SUBJECT",	clt_putsan },
+	[TV_EXCERPT] =	{ "EXCERPT",	clt_putmatch },
+};
+
+static int
+tmpl_push(struct template *tp, const char *str, size_t len, int var)
+{
+	struct tmpl_seg	*segs;
+
+	segs = recallocarray(tp->tp_segs, tp->tp_nsegs, tp->tp_nsegs + 1,
+	    sizeof(*segs));
+	if (segs == NULL)
+		return (-1);
+
+	segs[tp->tp_nsegs].ts_str = str;
+	segs[tp->tp_nsegs].ts_len = len;
+	segs[tp->tp_nsegs].ts_var = var;
+	tp->tp_segs = segs;
+	tp->tp_nsegs++;
+	return (0);
+}
+
+/*
+ * Compile the NUL-terminated text in buf, which must not be freed,
+ * replacing the variables in the vars mask.
+ */
+struct template *
+tmpl_compile(char *buf, unsigned int vars)
+{
+	struct template	*tp;
+	const char	*p, *t, *match;
+	int		 i, var;
+
+	if ((tp = calloc(1, sizeof(*tp))) == NULL)
+		return (NULL);
+	tp->tp_buf = buf;
+
+	p = buf;
+	while (*p != '\0') {
+		match = NULL;
+		var = -1;
+		for (i = 0; i < TV__MAX; ++i) {
+			if (!(vars & TMPL_VAR(i)))
+				continue;
+			t = strstr(p, tmpl_vars[i].name);
+			if (t != NULL && (match == NULL || t < match)) {
+				match = t;
+				var = i;
+			}
+		}
+
+		if (match == NULL) {
+			if (tmpl_push(tp, p, strlen(p), -1) == -1)
+				goto err;
+			break;
+		}
+
+		if (match != p && tmpl_push(tp, p, match - p, -1) == -1)
+			goto err;
+		if (tmpl_push(tp, NULL, 0, var) == -1)
+			goto err;
+		p = match + strlen(tmpl_vars[var].name);
+	}
+
+	return (tp);
+
+err:
+	free(tp->tp_segs);
+	free(tp);
+	return (NULL);
+}
+
+/*
+ * vals is indexed by the TV_* constants and may be NULL if the
+ * template has no variables.
+ */
+int
+tmpl_render(struct client *clt, const struct template *tp,
+    const char **vals)
+{
+	const struct tmpl_seg	*seg;
+	size_t			 i;
+	int			 r;
+
+	for (i = 0; i < tp->tp_nsegs; ++i) {
+		seg = &tp->tp_segs[i];
+		if (seg->ts_var == -1)
+			r = clt_putref(clt, seg->ts_str, seg->ts_len);
+		else
+			r = tmpl_vars[seg->ts_var].put(clt,
+			    vals != NULL ? vals[seg->ts_var] : NULL);
+		if (r == -1)
+			return (-1);
+	}
+
+	return (0);
+}
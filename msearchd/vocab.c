@@ -0,0 +1,304 @@
+/*
+ * This file is in the public domain.
+ */
+
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "msearchd.h"
+
+/*
+ * Estimate how many mails match a search from the number of mails
+ * that contain each of its terms, as found in fts5vocab tables over
+ * the index, assuming the terms to be independent.  A phrase is
+ * counted as its rarest word.  The terms are split and stemmed by the
+ * same tokenizer as the index, so they are looked up as stored.
+ */
+
+#define VOCAB_CACHE	256	/* entries */
+#define VOCAB_KEYLEN	48
+
+/* must match the tokenize option in schema.sql */
+#define VOCAB_TOKENIZER	"porter"
+static const char *vocab_tokargs[] = {
+	"unicode61", "remove_diacritics", "2",
+};
+
+/*
+ * Counting the mails with a term walks its whole doclist, so the
+ * counts are kept in a small direct-mapped cache.
+ */
+struct vocab_ent {
+	uint32_t	 ve_hash;
+	int64_t		 ve_doc;
+	char		 ve_key[VOCAB_KEYLEN];
+};
+
+struct vocab {
+	struct vocab_ent v_cache[VOCAB_CACHE];
+	fts5_tokenizer	 v_api;
+	Fts5Tokenizer	*v_tok;
+	sqlite3_stmt	*v_row;
+	sqlite3_stmt	*v_col;
+	int64_t		 v_ndocs;
+	int64_t		 v_oldest;
+	int64_t		 v_newest;
+};
+
+/* the lookup of a phrase */
+struct vocab_phrase {
+	struct vocab	*vp_vocab;
+	const char	*vp_col;	/* NULL if any */
+	int64_t		 vp_doc;	/* -1 if no token yet */
+};
+
+static int
+vocab_exec(sqlite3 *db, const char *sql)
+{
+	char		*errmsg;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_warnx("%s: \"%s\": %s", __func__, sql, errmsg);
+		sqlite3_free(errmsg);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+vocab_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		log_warnx("failed to prepare statement \"%s\": %s",
+		    sql, sqlite3_errmsg(db));
+		return (-1);
+	}
+	return (0);
+}
+
+struct vocab *
+vocab_open(struct sqlite3 *db)
+{
+	struct vocab	*v;
+	fts5_api	*api;
+	void		*ud;
+
+	if ((api = rank_fts5_api(db)) == NULL) {
+		log_warnx("%s: fts5 is not available", __func__);
+		return (NULL);
+	}
+
+	if ((v = calloc(1, sizeof(*v))) == NULL) {
+		log_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	if (api->xFindTokenizer(api, VOCAB_TOKENIZER, &ud, &v->v_api)
+	    != SQLITE_OK ||
+	    v->v_api.xCreate(ud, vocab_tokargs,
+	    sizeof(vocab_tokargs) / sizeof(vocab_tokargs[0]), &v->v_tok)
+	    != SQLITE_OK) {
+		log_warnx("%s: can't create the %s tokenizer", __func__,
+		    VOCAB_TOKENIZER);
+		free(v);
+		return (NULL);
+	}
+
+	/* the temp schema is writable even if the database is not */
+	if (vocab_exec(db, "create virtual table if not exists"
+	    " temp.email_row using fts5vocab(main, email, row)") == -1 ||
+	    vocab_exec(db, "create virtual table if not exists"
+	    " temp.email_col using fts5vocab(main, email, col)") == -1 ||
+	    vocab_prepare(db, "select doc from temp.email_row"
+	    " where term = ?", &v->v_row) == -1 ||
+	    vocab_prepare(db, "select doc from temp.email_col"
+	    " where term = ? and col = ?", &v->v_col) == -1)
+		goto err;
+
+	if (vocab_refresh(v) == -1)
+		goto err;
+	return (v);
+
+err:
+	vocab_close(v);
+	return (NULL);
+}
+
+/*
+ * Count the mails and the range of their dates again, and forget the
+ * counts of the terms, after mails were added.
+ */
+int
+vocab_refresh(struct vocab *v)
+{
+	sqlite3_stmt	*stmt;
+
+	if (v == NULL)
+		return (0);
+
+	memset(v->v_cache, 0, sizeof(v->v_cache));
+	v->v_ndocs = 0;
+
+	if (vocab_prepare(sqlite3_db_handle(v->v_row), "select count(*),"
+	    " min(date), max(date) from mail", &stmt) == -1)
+		return (-1);
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		v->v_ndocs = sqlite3_column_int64(stmt, 0);
+		v->v_oldest = sqlite3_column_int64(stmt, 1);
+		v->v_newest = sqlite3_column_int64(stmt, 2);
+	}
+	sqlite3_finalize(stmt);
+	return (0);
+}
+
+void
+vocab_close(struct vocab *v)
+{
+	if (v == NULL)
+		return;
+	sqlite3_finalize(v->v_row);
+	sqlite3_finalize(v->v_col);
+	if (v->v_tok != NULL)
+		v->v_api.xDelete(v->v_tok);
+	free(v);
+}
+
+static uint32_t
+vocab_hash(const char *key)
+{
+	uint32_t	 h = 2166136261U;	/* FNV-1a */
+
+	while (*key != '\0') {
+		h ^= (unsigned char)*key++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static int
+vocab_token(void *arg, int tflags, const char *tok, int len, int start,
+    int end)
+{
+	struct vocab_phrase	*vp = arg;
+	struct vocab_ent	*ve = NULL;
+	sqlite3_stmt		*stmt;
+	char			 key[VOCAB_KEYLEN];
+	uint32_t		 h = 0;
+	int64_t			 doc = 0;
+	int			 r, err;
+
+	/* synonyms are not looked up */
+	if (tflags & FTS5_TOKEN_COLOCATED)
+		return (SQLITE_OK);
+
+	r = snprintf(key, sizeof(key), "%s\t%.*s",
+	    vp->vp_col != NULL ? vp->vp_col : "", len, tok);
+	if (r >= 0 && (size_t)r < sizeof(key)) {
+		h = vocab_hash(key);
+		ve = &vp->vp_vocab->v_cache[h % VOCAB_CACHE];
+		if (ve->ve_hash == h && !strcmp(ve->ve_key, key)) {
+			doc = ve->ve_doc;
+			goto done;
+		}
+	}
+
+	stmt = vp->vp_col != NULL ? vp->vp_vocab->v_col : vp->vp_vocab->v_row;
+	err = sqlite3_bind_text(stmt, 1, tok, len, SQLITE_STATIC);
+	if (err == SQLITE_OK && vp->vp_col != NULL)
+		err = sqlite3_bind_text(stmt, 2, vp->vp_col, -1,
+		    SQLITE_STATIC);
+	if (err == SQLITE_OK && (err = sqlite3_step(stmt)) == SQLITE_ROW)
+		doc = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+	if (err != SQLITE_ROW && err != SQLITE_DONE)
+		return (err);
+
+	if (ve != NULL) {
+		ve->ve_hash = h;
+		ve->ve_doc = doc;
+		strlcpy(ve->ve_key, key, sizeof(ve->ve_key));
+	}
+
+done:
+	if (vp->vp_doc == -1 || doc < vp->vp_doc)
+		vp->vp_doc = doc;
+	return (SQLITE_OK);
+}
+
+/*
+ * Walk the FTS5 expression built by query_parse: a sequence of
+ * quoted phrases, each optionally preceded by a "{column} : " filter.
+ * datemin and datemax are INT64_MIN and INT64_MAX when not filtering.
+ */
+int64_t
+vocab_estimate(struct vocab *v, const char *esc, int64_t datemin,
+    int64_t datemax)
+{
+	struct vocab_phrase	 vp;
+	char			 col[16], buf[QUERY_MAXLEN];
+	const char		*p = esc;
+	double			 est, lo, hi;
+	size_t			 len, n;
+
+	if (v == NULL || v->v_ndocs == 0)
+		return (-1);
+
+	est = v->v_ndocs;
+	for (;;) {
+		p += strspn(p, " ");
+		if (*p == '\0')
+			break;
+
+		memset(&vp, 0, sizeof(vp));
+		vp.vp_vocab = v;
+		vp.vp_doc = -1;
+
+		if (*p == '{') {
+			len = strcspn(++p, "}");
+			if (p[len] != '}' || len >= sizeof(col))
+				return (-1);
+			memcpy(col, p, len);
+			col[len] = '\0';
+			vp.vp_col = col;
+			p += len + 1;
+			p += strspn(p, " :");
+		}
+
+		if (*p++ != '"')
+			return (-1);
+		for (n = 0; *p != '\0'; ++p) {
+			if (*p == '"' && *++p != '"')
+				break;
+			if (n == sizeof(buf) - 1)
+				return (-1);
+			buf[n++] = *p;
+		}
+
+		if (v->v_api.xTokenize(v->v_tok, &vp, FTS5_TOKENIZE_QUERY,
+		    buf, n, vocab_token) != SQLITE_OK)
+			return (-1);
+		if (vp.vp_doc != -1)
+			est *= (double)vp.vp_doc / v->v_ndocs;
+	}
+
+	/* assume the mails to be evenly spread over time */
+	if ((datemin > v->v_oldest || datemax < v->v_newest) &&
+	    v->v_newest > v->v_oldest) {
+		lo = datemin > v->v_oldest ? datemin : v->v_oldest;
+		hi = datemax < v->v_newest ? datemax : v->v_newest;
+		if (hi <= lo)
+			return (0);
+		est *= (hi - lo) / (v->v_newest - v->v_oldest);
+	}
+
+	return ((int64_t)(est + 0.5));
+}